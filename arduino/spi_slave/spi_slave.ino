@@ -5,11 +5,32 @@
 #include <string.h>
 #include <stdio.h>
 
-char buf [100];
+char buf [160];
 char readable [500];
 volatile byte pos;
 volatile boolean process_it;
 
+// Link layer, see protocol.h: frames arrive COBS encoded with a sequence number in
+// front and a CRC-16 behind, each one ended by a 0 byte. From the start of every
+// transfer (SS going low) we shift out our status: 0x5A, the sequence number we want
+// next, how many frames we threw away and a check byte, then the echo of a link
+// test frame if one came in. It's updated in loop(), so it lags behind a little,
+// the microcontroller copes with that. We're slow to answer, so the
+// microcontroller's bitrate test will settle on a low bitrate.
+#define STATUS_MAGIC 0x5A
+#define STATUS_SIZE  4
+#define FRAME_LINK_TEST 4
+
+char wire [170];            // encoded frame coming in
+volatile byte wire_pos;
+char pending [170];         // a complete encoded frame for loop()
+volatile byte pending_size;
+volatile byte reply [STATUS_SIZE + 33] = {STATUS_MAGIC, 0, 0, 0xFF};
+volatile byte reply_size = STATUS_SIZE;
+volatile byte reply_pos;
+byte expected_sequence = 0;
+byte frame_errors = 0;
+
 void setup (void)
 {
   Serial.begin (9600);   // debugging
@@ -23,60 +44,209 @@ void setup (void)
   pinMode(SCK, INPUT);
 
   // get ready for an interrupt
+  SPDR = STATUS_MAGIC;
+  wire_pos = 0;
+  reply_pos = 1;
   pos = 0;   // buffer empty
   memset(buf, 0, sizeof(buf));
   process_it = false;
 
-  // now turn on interrupts
+  // now turn on interrupts, SS (PB2) going low starts the status over
+  PCMSK0 |= _BV(PCINT2);
+  PCICR |= _BV(PCIE0);
   SPI.attachInterrupt();
   Serial.println("Hey there");
 }  // end of setup
 
 
+// Frames as sent by the microcontroller, see includes/efm32_headers/protocol.h
+#define PROTOCOL_VERSION 1
+#define FRAME_GLOBAL_STATE 1
+#define FRAME_GENERATOR    2
+#define FRAME_PATCH        3
+#define GLOBAL_SIZE    32
+#define GENERATOR_SIZE 9
+
+byte frame_version() { return (byte)buf[0] >> 4; }
+byte frame_type()    { return (byte)buf[0] & 0x0F; }
+
+uint16_t get_u16(const char* p) { return (byte)p[0] | ((uint16_t)(byte)p[1] << 8); }
+uint32_t get_u32(const char* p) { return get_u16(p) | ((uint32_t)get_u16(p + 2) << 16); }
+
+// size of a patch record by its opcode
+byte patch_record_size(byte opcode)
+{
+  switch (opcode) {
+    case 1: return 9;  // whole generator
+    case 2: return 4;  // enabled
+    case 3: return 4;  // velocity
+    case 4: return 3;  // pitchwheel
+    case 5: return 2;  // master volume
+    case 6: return 15; // envelope
+    default: return 0;
+  }
+}
+
+uint16_t crc16(const byte* data, uint16_t length)
+{
+  uint16_t crc = 0xFFFF;
+  for (uint16_t i = 0; i < length; i++) {
+    crc ^= (uint16_t)data[i] << 8;
+    for (byte bit = 0; bit < 8; bit++)
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+  }
+  return crc;
+}
+
+// returns the decoded length, 0 if broken
+uint16_t cobs_decode(const byte* in, uint16_t length, byte* out)
+{
+  uint16_t at = 0;
+  for (uint16_t i = 0; i < length; ) {
+    byte code = in[i++];
+    if (code == 0 || i + code - 1 > length) return 0;
+    for (byte j = 1; j < code; j++) out[at++] = in[i++];
+    if (code != 0xFF && i < length) out[at++] = 0;
+  }
+  return at;
+}
+
 // SPI interrupt routine
 ISR (SPI_STC_vect)
 {
   byte c = SPDR;  // grab byte from SPI Data Register
 
-  // add to buffer if room
-  if (pos < (sizeof (buf) - 1))
-    buf [pos++] = c;
-  Serial.print(c);
-  Serial.print(" ");
-  // example: newline means time to process buffer
-  if ((buf[0] == 1 && pos >= 22) || (buf[0] == 2 && pos >= 10)) {
-    Serial.print("\n");
-    process_it = true;
-  } else if (buf[0] != 1 && buf[0] != 2 && c == '\0') {
-    process_it = true;
+  if (c == 0) {
+    // end of a frame, or the zeros of a status poll
+    if (wire_pos > 0 && !process_it) {
+      memcpy(pending, wire, wire_pos);
+      pending_size = wire_pos;
+      process_it = true;
+    }
+    wire_pos = 0;
+  } else if (wire_pos < sizeof (wire)) {
+    wire [wire_pos++] = c;
   }
-
+  SPDR = reply_pos < reply_size ? reply [reply_pos++] : 0;
 }  // end of interrupt routine SPI_STC_vect
 
+// start of a transfer
+ISR (PCINT0_vect)
+{
+  if (PINB & _BV(PINB2)) {
+    reply_size = STATUS_SIZE; // an echo only goes out once
+    return;
+  }
+  reply_pos = 0;
+  SPDR = reply [reply_pos++];
+}
+
+// decodes pending into buf, false if it's broken or not the next one
+bool take_frame()
+{
+  static byte raw [170];
+  uint16_t size = cobs_decode((const byte*)pending, pending_size, raw);
+  if (size < 4 || size - 3 > sizeof (buf) || crc16(raw, size - 2) != (raw[size - 2] | ((uint16_t)raw[size - 1] << 8))) {
+    Serial.println("Broken frame");
+    frame_errors++;
+    return false;
+  }
+  if (raw[1] >> 4 == PROTOCOL_VERSION && (raw[1] & 0x0F) == FRAME_LINK_TEST && size - 3 <= 33) {
+    // bitrate test, send it back whatever its sequence number
+    noInterrupts();
+    for (byte i = 0; i < size - 3; i++) reply[STATUS_SIZE + i] = raw[1 + i];
+    reply_size = STATUS_SIZE + size - 3;
+    interrupts();
+    return false;
+  }
+  if (raw[0] != expected_sequence) {
+    // a repeat of one we have is fine, a gap means we missed one
+    if ((byte)(expected_sequence - raw[0]) > 0x80) {
+      Serial.println("Missed a frame");
+      frame_errors++;
+    }
+    return false;
+  }
+  expected_sequence++;
+  pos = size - 3;
+  memcpy(buf, raw + 1, pos);
+  return true;
+}
+
+void print_envelope(const char* p)
+{
+  snprintf(readable, 500, "env_attack: %7lu, env_decay: %7lu, env_sustain: %6d, env_release: %7lu",
+  (unsigned long)get_u32(p), (unsigned long)get_u32(p + 4), (int16_t)get_u16(p + 8), (unsigned long)get_u32(p + 10));
+  Serial.println(readable);
+}
+
+void print_generator(const char* p)
+{
+  snprintf(readable, 500, "generator_index: %6u, reset_note: %1u, enabled: %1u, instruments: %3u, note_index: %3u, channel_index: %3u, velocity: %3u",
+  get_u16(p), (byte)p[2], (byte)p[3], (byte)p[4], (byte)p[5], (byte)p[6], (byte)p[7]);
+  Serial.println(readable);
+}
+
 // main loop - wait for flag set in interrupt routine
 void loop (void)
 {
   if (process_it)
   {
-    if (buf[0] == 1) { //global
-      //Serial.println("Global");
-      snprintf(readable, 500, "master_volume: %5d, env_attack: %5d, env_decay: %5d, env_sustain: %3d, env_release: %5d",
-      *(uint16_t*)&buf[1], *(uint16_t*)&buf[3], *(uint16_t*)&buf[5], buf[7], *(uint16_t*)&buf[8]);
+    bool good = take_frame();
+    noInterrupts();
+    reply[1] = expected_sequence;
+    reply[2] = frame_errors;
+    reply[3] = ~(expected_sequence ^ frame_errors);
+    interrupts();
+    if (!good) {
+      // nothing to print
+    } else if (frame_version() != PROTOCOL_VERSION) {
+      Serial.print("Unknown protocol version: ");
+      for (uint16_t i = 0; i < pos; i++) {
+          Serial.print((byte)buf[i], HEX);
+          Serial.print(" ");
+      }
+      Serial.print('\n');
+    } else if (frame_type() == FRAME_GLOBAL_STATE) {
+      snprintf(readable, 500, "master_volume: %3u", (byte)buf[1]);
       Serial.println(readable);
+      print_envelope(&buf[2]);
       Serial.println("Pitch wheels:");
       for (uint8_t i = 0; i < 16; i++) {
         Serial.print("\t");
-        Serial.println(buf[10+i], HEX);
+        Serial.println((int8_t)buf[16+i]);
       }
       Serial.print('\n');
-    } else if (buf[0] == 2) { //generator
-      //Serial.println("Generator");
-      // snprintf(readable, 500, "generator_index: %6u, reset_note: %1u, enabled: %1u, instruments: %3u, note_index: %3u, channel_index: %3u, velocity: %3u",
-      // *(uint16_t*)&buf[1], buf[3], buf[4], buf[5], buf[6], buf[7], buf[8]);
-      // Serial.println(readable);
+    } else if (frame_type() == FRAME_GENERATOR) {
+      print_generator(&buf[1]);
+    } else if (frame_type() == FRAME_PATCH) {
+      byte at = 2;
+      for (byte i = 0; i < (byte)buf[1]; i++) {
+        const char* record = &buf[at];
+        byte size = patch_record_size(record[0]);
+        if (size == 0) break;
+        if (record[0] == 1) {
+          print_generator(&record[1]);
+        } else if (record[0] == 2) {
+          snprintf(readable, 500, "generator_index: %6u, enabled: %1u", get_u16(&record[1]), (byte)record[3]);
+          Serial.println(readable);
+        } else if (record[0] == 3) {
+          snprintf(readable, 500, "generator_index: %6u, velocity: %3u", get_u16(&record[1]), (byte)record[3]);
+          Serial.println(readable);
+        } else if (record[0] == 4) {
+          snprintf(readable, 500, "pitchwheel %2u: %4d", (byte)record[1], (int8_t)record[2]);
+          Serial.println(readable);
+        } else if (record[0] == 5) {
+          snprintf(readable, 500, "master_volume: %3u", (byte)record[1]);
+          Serial.println(readable);
+        } else if (record[0] == 6) {
+          print_envelope(&record[1]);
+        }
+        at += size;
+      }
     } else {
-      for (uint16_t i = 0; i < 100; i++) {
-          Serial.print(buf[i], HEX);
+      for (uint16_t i = 0; i < pos; i++) {
+          Serial.print((byte)buf[i], HEX);
           Serial.print(" ");
       }
       Serial.print('\n');
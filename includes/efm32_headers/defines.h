@@ -13,7 +13,18 @@
 #define OUTPUT_CLOCK 0  // Enabling this disables UART0 and clocks down the MCU to 16MHz!
 #define SPI_GPIO // Defining this outputs SPI on GPIO pins instead of directly to the FPGA.
 //#define SPI_FPGA
-#define SPI_BITRATE 100000
-#define SPI_SPAM 1
+#define SPI_BITRATE 100000 // until spi_qualify_bitrate has found out how fast the FPGA can go
+#ifndef FPGA_TRANSPORT // the host builds in tests/ use TRANSPORT_LOOPBACK
+#define FPGA_TRANSPORT TRANSPORT_SPI // or TRANSPORT_EBI, TRANSPORT_LOOPBACK, see transport.h
+#endif
+//#define EBI_MEMORY // The EBI registers are a plain array, for testing on a PC
+//#define SPI_LOOPBACK 2000000 // No FPGA, spi.c answers like one whose bus works up to this bitrate
+#define SPI_SPAM 0 // Keep polling the FPGA status over SPI while there is nothing new
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 1 // Time events from USB arrival to SPI completion, see latency.h
+#endif
+#define SAMPLE_RATE 44100 // of the FPGA audio output, Time is counted in samples
+#define REFRESH_BUS_SHARE 5 // percent of the SPI bandwidth the background state refresh may use
+#define REFRESH_TICK_HZ 100 // how often the main loop wakes up to refresh while idle
 
 #endif /* INCLUDES_EFM32_HEADERS_DEFINES_H_ */
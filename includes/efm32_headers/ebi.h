@@ -0,0 +1,42 @@
+#ifndef HEADERS_EBI_H_
+#define HEADERS_EBI_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "defines.h"
+#include "protocol.h"
+
+// The FPGA's registers mapped into memory over the EBI, instead of sending frames
+// over SPI. Every register is 16 bits, offsets below are in registers. Frames are
+// decoded here and each record writes only its own registers as it is decoded, so
+// a generator update is three stores and a velocity change one. A generator's record takes effect when its control
+// register is written, that is written last.
+#define EBI_REG_MASTER_VOLUME  0x000
+#define EBI_REG_ENVELOPE       0x001 // attack low, high, decay low, high, sustain, release low, high
+#define EBI_ENVELOPE_REGS      7
+#define EBI_REG_PITCHWHEEL(ch) (0x010 + (ch)) // sign extended
+#define EBI_REG_GENERATOR(idx) (0x040 + (idx) * 4)
+#define EBI_GENERATOR_CONTROL  0 // enabled in bit 0, restart the note in bit 1, instrument in 15..8
+#define EBI_GENERATOR_NOTE     1 // note_index in 7..0, channel_index in 15..8
+#define EBI_GENERATOR_VELOCITY 2
+#define EBI_CONTROL_ENABLED    0x0001
+#define EBI_CONTROL_RESTART    0x0002
+#define EBI_WINDOW_REGS        EBI_REG_GENERATOR(N_GENERATORS)
+
+typedef struct EbiStats{
+	uint32_t frames;     // applied to the registers
+	uint32_t frames_bad; // that didn't decode, nothing written then
+	uint32_t stores;     // register writes
+} EbiStats;
+
+void ebi_init(void);
+
+// Same as spi_transmit, but the frame is in the registers when it returns
+bool ebi_transmit(const uint8_t* data, uint16_t data_size);
+bool ebi_transmit_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count);
+bool ebi_idle(void);
+EbiStats ebi_get_stats(void);
+const volatile uint16_t* ebi_window(void);
+
+#endif /* HEADERS_EBI_H_ */
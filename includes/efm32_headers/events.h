@@ -0,0 +1,31 @@
+#ifndef HEADERS_EVENTS_H_
+#define HEADERS_EVENTS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "midi.h"
+
+// Interrupt handlers only post events here, everything that touches the generators
+// or the SPI bus happens in the main loop when it takes them back out.
+#define EVENT_QUEUE_SIZE 32 // power of two
+
+typedef enum EventType{
+	EVENT_MIDI,    // a MIDI message from any source
+	EVENT_BUTTONS, // new state of the buttons, one bit per button
+} EventType;
+
+typedef struct Event{
+	EventType type;
+	union {
+		MIDI_packet midi;
+		uint32_t buttons;
+	};
+} Event;
+
+bool postEvent(const Event* event);
+bool takeEvent(Event* event);
+bool hasEvent(void);
+uint32_t getDroppedEvents(void);
+
+#endif /* HEADERS_EVENTS_H_ */
@@ -22,13 +22,41 @@ typedef byte			Pitch;	  // also goes from 0 to 127, where 64(?) is default pitch
 typedef int16_t			Sample;   // To represent a single audio "frame"
 typedef unsigned int    Time;     // measured in n samples, meaning x second is represented as x * SAMPLE_RATE
 
+#ifndef N_GENERATORS // the host builds in tests/ try other sizes
 #define N_GENERATORS    16 /*number of supported notes playing simultainiously  (polytones), \
                              subject to change, chisel and microcontroller code \
                              should scale from this single variable alone */
+#endif
 
-#define OVERRIDE_ON_FULL /* If this is defined the generator that has been on the longest \
+#if N_GENERATORS + 2 <= 0xFF // the allocator needs two extra indices for its list heads
+typedef byte            GeneratorIndex;
+#else
+typedef ushort          GeneratorIndex;
+#endif
+
+// A bit per generator, see the mask_ helpers in fpga.c
+#define GENERATOR_MASK_WORDS ((N_GENERATORS + 31) / 32)
+typedef uint32_t GeneratorMask[GENERATOR_MASK_WORDS];
+
+#define OVERRIDE_ON_FULL /* If this is defined a generator chosen by VOICE_STEAL_POLICY \
  	 	 	 	 	 	 	will be overridden when a new generator is needed */
 
+// Voice stealing policies, selected at compile time with VOICE_STEAL_POLICY
+#define STEAL_OLDEST          0 // the generator that has been on the longest
+#define STEAL_LOWEST_VELOCITY 1 // the softest note, the lowest generator index on ties
+#define STEAL_RELEASED_FIRST  2 // only reuse released or sustained generators, never cut off a held key
+#define STEAL_SAME_NOTE       3 // a generator playing the same note on another channel, else the oldest
+#define STEAL_ROUND_ROBIN     4 // hand out generators in index order, and steal in that order when full
+#define STEAL_QUIETEST        5 // the generator with the lowest estimated envelope level times velocity
+
+#ifndef VOICE_STEAL_POLICY
+#define VOICE_STEAL_POLICY STEAL_QUIETEST
+#endif
+
+#define PENDING_NOTE_QUEUE_SIZE 8 /* note-ons that arrive when every generator is busy and none may \
+                                     be stolen wait here, and start as soon as a generator frees up */
+#define PENDING_NOTE_MAX_AGE    (SAMPLE_RATE / 10) /* waiting notes older than this are dropped instead */
+
 typedef struct Envelope { // either preset or controlled by knobs/buttons on the PCB
     Time   attack;
     Time   decay;
@@ -37,18 +65,17 @@ typedef struct Envelope { // either preset or controlled by knobs/buttons on the
 } __attribute__((packed)) Envelope;
 
 
-// The following two structs represent the two packet types to be transmitted
-// from the microcontroller to the FPGA:
+// The following two structs are the state the FPGA is told about, see protocol.h
+// for how they are laid out on the wire:
 
 typedef struct MicrocontrollerGlobalState {
     Velocity   master_volume;
-    Envelope*  envelope;
+    Envelope   envelope;
     sbyte      pitchwheels [N_MIDI_CHANNELS];
 } __attribute__((packed)) MicrocontrollerGlobalState;
 
 typedef struct MicrocontrollerGeneratorState {
     // this is the state of a single fpga generator as seen on the microprocessor,
-    // it is also the packet sent over SPI from the microcontroller to the FPGA
     // It represents the state of a single sound generator
     bool       enabled;           // whether the sound generator should be generating audio or not
     Instrument instrument;        // the index determining which waveform to use
@@ -57,17 +84,49 @@ typedef struct MicrocontrollerGeneratorState {
     Velocity   velocity;          // to know which pitchwheel to use
 } __attribute__((packed)) MicrocontrollerGeneratorState;
 
-uint find_unused_generator_id(MicrocontrollerGeneratorState** generator_states);
-uint find_longest_active_generator_id();
-uint find_specific_generator_id(NoteIndex note_index, uint channel_index, MicrocontrollerGeneratorState** generator_states);
+typedef struct SpiUpdateStats {
+    uint frames;  // sent to the FPGA
+    uint bytes;   // in those frames
+    uint records; // patch records in them
+    uint skipped; // updates where nothing had changed since the last one
+    uint refreshed; // records sent again by the background refresh
+} SpiUpdateStats;
+
+typedef struct GeneratorStats {
+    uint notes_stolen;   // note-ons that took over a generator playing another note
+    uint notes_queued;   // note-ons that had to wait for a free generator
+    uint notes_late;     // waiting note-ons that got a generator in time
+    uint notes_expired;  // waiting note-ons that were older than PENDING_NOTE_MAX_AGE
+    uint notes_dropped;  // note-ons lost because the pending queue was full
+} GeneratorStats;
+
+typedef struct GeneratorBank {
+    // everything the microcontroller knows about the FPGA, in one contiguous block
+    MicrocontrollerGeneratorState generators [N_GENERATORS];
+    MicrocontrollerGlobalState    global;
+} GeneratorBank;
+
+void generator_bank_init(void);
+uint acquire_generator_id(NoteIndex note_index, ChannelIndex channel_index, Velocity velocity);
+uint steal_generator_id(NoteIndex note_index, ChannelIndex channel_index, Velocity velocity);
+void retrigger_generator_id(uint idx, Velocity velocity);
+void release_generator_id(uint idx);
+uint find_specific_generator_id(NoteIndex note_index, ChannelIndex channel_index);
 byte is_valid_generator_id(uint idx);
 void update_generator_state(MicrocontrollerGeneratorState* generator_state, bool enabled, NoteIndex note_index, uint channel_index, Velocity velocity);
-MicrocontrollerGeneratorState* generator_state_new(void);
-MicrocontrollerGlobalState* global_state_new(void);
 
-void handleMIDIEvent(MIDI_packet* m, MicrocontrollerGeneratorState** generator_states);
+const GeneratorStats* get_generator_stats(void);
+const GeneratorBank* get_generator_bank(void); // what the FPGA should have
+
+void handleMIDIEvent(MIDI_packet* m);
 
-void microcontroller_send_global_state_update(const MicrocontrollerGlobalState* global_state);
-void microcontroller_send_generator_update(ushort generator_index, bool reset_note_lifetime, const MicrocontrollerGeneratorState** generator_states);
+void microcontroller_send_global_state_update(void);
+void microcontroller_send_generator_update(ushort generator_index, bool reset_note_lifetime);
+void microcontroller_begin_batch(void);
+void microcontroller_end_batch(void);
+void microcontroller_forget_fpga_state(void);
+void microcontroller_resend_fpga_state(void);
+bool microcontroller_refresh_fpga_state(void);
+const SpiUpdateStats* get_spi_update_stats(void);
 
 #endif /* SRC_FPGA_H_ */
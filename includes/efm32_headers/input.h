@@ -9,6 +9,7 @@
 #define INCLUDES_EFM32_HEADERS_INPUT_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include "midi.h"
 #include "defines.h"
 
@@ -19,7 +20,9 @@
 bool connectToInput();
 bool inputConnected();
 int getInstrumentValue();
-MIDI_packet waitForInput();
-void handleMultipleButtonPresses();
+#define INPUT_MAX_EVENTS 64 // USB-MIDI events handled per processInput, four full packets
+
+size_t processInput(void);
+void handleMultipleButtonPresses(uint32_t buttons);
 
 #endif /* INCLUDES_EFM32_HEADERS_INPUT_H_ */
@@ -0,0 +1,75 @@
+#ifndef HEADERS_LATENCY_H_
+#define HEADERS_LATENCY_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "defines.h"
+
+// Times how long an event takes from USB arrival until the SPI transfer carrying
+// its result is done, using the core's cycle counter. Each event is traced through
+// the points below, and the time between consecutive points is collected into a
+// stage with min/mean/max and a histogram with log2 buckets.
+// The SPI frames go out after the event is handled, so a trace that got as far
+// as queueing one is parked until the transfer completes, see latencySpiDone.
+// Read it out with latencyDump, python-latency/decode_latency.py decodes it.
+typedef enum LatencyPoint{
+	LATENCY_USB_DONE,  // USB transfer completed (in the interrupt)
+	LATENCY_PARSED,    // decoded into MIDI events
+	LATENCY_ALLOCATED, // generator picked, first update encoded
+	LATENCY_SPI_QUEUED, // first frame put in the SPI queue
+	LATENCY_SPI_START, // that frame handed to the SPI driver
+	LATENCY_SPI_DONE,  // and its transfer complete
+	N_LATENCY_POINTS
+} LatencyPoint;
+
+// Stage i is point i to point i + 1, the last one is the whole way through
+#define N_LATENCY_STAGES N_LATENCY_POINTS
+#define LATENCY_TOTAL    (N_LATENCY_STAGES - 1)
+#define N_LATENCY_BUCKETS 32 // bucket b counts times in [2^b, 2^(b+1)) cycles, 0 in bucket 0
+
+#define LATENCY_DUMP_MAGIC   0x3154414C // "LAT1"
+#define LATENCY_DUMP_VERSION 2
+// header: magic, version, stages, buckets, core clock in Hz
+// per stage: count, min, max, sum (64 bit), then the buckets. All little endian.
+#define LATENCY_DUMP_SIZE (4 + 2 + 1 + 1 + 4 + N_LATENCY_STAGES * (4 + 4 + 4 + 8 + 4 * N_LATENCY_BUCKETS))
+
+typedef struct LatencyStage{
+	uint32_t count;
+	uint32_t min;
+	uint32_t max;
+	uint64_t sum;
+	uint32_t buckets[N_LATENCY_BUCKETS];
+} LatencyStage;
+
+#if LATENCY_STATS
+void latencyInit(void);
+uint32_t latencyNow(void);
+void latencyStart(uint32_t arrival);
+void latencyMark(LatencyPoint point);
+void latencyMarkAt(LatencyPoint point, uint32_t time);
+void latencyFinish(void);
+void latencySpiQueued(uint32_t frame);
+void latencySpiDone(uint32_t frame, uint32_t started, uint32_t finished);
+void latencyCollect(void);
+void latencyReset(void);
+const LatencyStage* getLatencyStage(unsigned int stage);
+size_t latencyDump(uint8_t* buffer, size_t size);
+
+// Filled by latencyDump for a debugger to save, see python-latency/readme.txt
+extern uint8_t latency_snapshot[LATENCY_DUMP_SIZE];
+#else
+static inline void latencyInit(void) {}
+static inline uint32_t latencyNow(void) { return 0; }
+static inline void latencyStart(uint32_t arrival) { (void) arrival; }
+static inline void latencyMark(LatencyPoint point) { (void) point; }
+static inline void latencyMarkAt(LatencyPoint point, uint32_t time) { (void) point; (void) time; }
+static inline void latencyFinish(void) {}
+static inline void latencySpiQueued(uint32_t frame) { (void) frame; }
+static inline void latencySpiDone(uint32_t frame, uint32_t started, uint32_t finished) { (void) frame; (void) started; (void) finished; }
+static inline void latencyCollect(void) {}
+static inline void latencyReset(void) {}
+#endif
+
+#endif /* HEADERS_LATENCY_H_ */
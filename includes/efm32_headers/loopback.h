@@ -0,0 +1,29 @@
+#ifndef HEADERS_LOOPBACK_H_
+#define HEADERS_LOOPBACK_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "defines.h"
+#include "protocol.h"
+
+// Stands in for the FPGA when running on a PC. Frames are checked by decoding
+// them, and appended to LOOPBACK_FILE (or the file named by the environment
+// variable of the same name) as a little endian u16 length followed by the frame,
+// for throughput tests and for looking at afterwards.
+#define LOOPBACK_FILE "fpga_frames.bin"
+
+typedef struct LoopbackStats{
+	uint32_t frames;
+	uint32_t frames_bad; // didn't decode, still written to the file
+	uint64_t bytes;
+} LoopbackStats;
+
+void loopback_init(void);
+bool loopback_transmit(const uint8_t* data, uint16_t data_size);
+bool loopback_transmit_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count);
+void loopback_flush(void);
+LoopbackStats loopback_get_stats(void);
+const ProtocolMirror* loopback_mirror(void); // what the FPGA would have been told
+
+#endif /* HEADERS_LOOPBACK_H_ */
@@ -42,11 +42,42 @@ typedef struct MIDI_packet{
 	byte data[3];
 } MIDI_packet;
 
+// USB-MIDI carries MIDI as 4 byte event packets: a Cable Number/Code Index
+// Number byte followed by up to three MIDI bytes, several of them per USB packet.
+#define USB_MIDI_EVENT_SIZE 4
+
 typedef struct MIDI_cntrl_packet{
 	byte data[2];
 } MIDI_cntrl_packet;
 
+// Incremental parser for a raw MIDI byte stream (as from a UART), with running
+// status, realtime bytes in the middle of other messages and SysEx.
+// Complete messages are passed to on_event, and SysEx data bytes are passed to
+// on_sysex in runs taken straight from the input buffer.
+// Nothing in the firmware calls it yet: the only MIDI input is USB-MIDI, which
+// comes already split into events (MIDI_decode_USB_packet). It is for a DIN MIDI
+// input on a UART, which the board doesn't have wired up, and is tested on the
+// host in tests/test_midi.c.
+typedef void (*MIDI_event_handler)(MIDI_packet* m, void* context);
+typedef void (*MIDI_sysex_handler)(const byte* data, size_t length, bool complete, void* context);
+
+typedef struct MIDI_parser{
+	MIDI_event_handler on_event;
+	MIDI_sysex_handler on_sysex; // may be NULL
+	void*              context;
+	MIDI_packet        message;  // being assembled, data[0] is the running status or 0 if there is none
+	byte               expected; // number of data bytes the status needs
+	byte               received; // number of data bytes received so far
+	bool               in_sysex;
+} MIDI_parser;
+
 MIDI_packet_info get_MIDI_packet_info(const byte* data);
 bool validate_MIDI_packet(const byte* data, size_t length);
+byte MIDI_data_length(byte status);
+byte MIDI_USB_event_length(byte code_index);
+size_t MIDI_decode_USB_packet(const byte* data, size_t length, MIDI_packet* events, size_t max_events);
+
+void MIDI_parser_init(MIDI_parser* parser, MIDI_event_handler on_event, MIDI_sysex_handler on_sysex, void* context);
+void MIDI_parse(MIDI_parser* parser, const byte* data, size_t length);
 
 #endif /* SRC_MIDI_H_ */
@@ -0,0 +1,124 @@
+#ifndef HEADERS_PROTOCOL_H_
+#define HEADERS_PROTOCOL_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "fpga.h"
+
+// What goes over SPI to the FPGA. Every frame starts with a header byte holding
+// the protocol version in the top nibble and the frame type in the bottom one, so
+// the FPGA can tell frames from a newer or older microcontroller apart. Multi byte
+// fields are little endian and nothing is padded, the layout below is the layout
+// on the wire regardless of how the structs are laid out in RAM.
+#define PROTOCOL_VERSION 1
+#define PROTOCOL_HEADER(type)  ((PROTOCOL_VERSION << 4) | (type))
+#define PROTOCOL_VERSION_OF(header) ((header) >> 4)
+#define PROTOCOL_TYPE_OF(header)    ((header) & 0x0F)
+
+// Frame types
+#define FRAME_GLOBAL_STATE 1 // master_volume, envelope, pitchwheels
+#define FRAME_GENERATOR    2 // one generator record
+#define FRAME_PATCH        3 // record count, then that many records, each starting with an opcode
+#define FRAME_LINK_TEST    4 // a test pattern the FPGA echoes back, see spi_qualify_bitrate
+
+// Envelope: attack u32, decay u32, sustain i16, release u32, times in samples
+#define PROTOCOL_ENVELOPE_SIZE 14
+// Generator record: index u16, reset_note_lifetime, enabled, instrument, note_index,
+// channel_index, velocity
+#define PROTOCOL_GENERATOR_RECORD_SIZE 8
+#define PROTOCOL_GLOBAL_SIZE    (1 + 1 + PROTOCOL_ENVELOPE_SIZE + N_MIDI_CHANNELS)
+#define PROTOCOL_GENERATOR_SIZE (1 + PROTOCOL_GENERATOR_RECORD_SIZE)
+
+// Patch record opcodes, sizes include the opcode
+#define PATCH_GENERATOR     1 // generator record
+#define PATCH_ENABLED       2 // index u16, enabled
+#define PATCH_VELOCITY      3 // index u16, velocity
+#define PATCH_PITCHWHEEL    4 // channel, pitchwheel (signed)
+#define PATCH_MASTER_VOLUME 5 // master_volume
+#define PATCH_ENVELOPE      6 // envelope
+#define PATCH_GENERATOR_SIZE     (1 + PROTOCOL_GENERATOR_RECORD_SIZE)
+#define PATCH_FIELD_SIZE         4
+#define PATCH_PITCHWHEEL_SIZE    3
+#define PATCH_MASTER_VOLUME_SIZE 2
+#define PATCH_ENVELOPE_SIZE      (1 + PROTOCOL_ENVELOPE_SIZE)
+#define PATCH_HEADER_SIZE        2 // frame header and record count
+
+#define PROTOCOL_MAX_FRAME_SIZE 160 // fits a patch of 16 generator records
+
+// The FPGA's side of things, what decoding frames builds up
+typedef struct ProtocolMirror {
+    MicrocontrollerGeneratorState generators [N_GENERATORS];
+    MicrocontrollerGlobalState    global;
+    uint                          note_resets; // records that restarted a note
+    GeneratorMask                 restarted;   // generators whose note was restarted, cleared by the reader
+} ProtocolMirror;
+
+// Link layer. Every frame above goes over the wire as
+//   COBS(sequence number, frame, CRC-16 of both) followed by a 0 byte
+// so a dropped or corrupted byte only costs the frame it was in, the receiver
+// resynchronises on the next 0. The CRC is CRC-16/CCITT-FALSE, sent little endian.
+// From the start of every transfer (chip select going low) the FPGA shifts out its
+// status: PROTOCOL_STATUS_MAGIC, the sequence number it expects next, a count of
+// frames it had to throw away and PROTOCOL_STATUS_CHECK of those two. It only takes frames in sequence order, so after a
+// loss everything from the lost frame on is sent again. Repeats of frames it already
+// has are ignored. A good FRAME_LINK_TEST frame is taken whatever its sequence
+// number, and echoed back whole after the status in the next transfer.
+#define PROTOCOL_STATUS_MAGIC 0x5A
+#define PROTOCOL_STATUS_SIZE  4
+#define PROTOCOL_STATUS_CHECK(expected, errors) ((byte) ~((expected) ^ (errors)))
+#define PROTOCOL_LINK_TEST_SIZE 32 // largest test pattern
+#define PROTOCOL_LINK_OVERHEAD 3 // sequence number and CRC
+#define PROTOCOL_WIRE_SIZE(frame_size) \
+	((frame_size) + PROTOCOL_LINK_OVERHEAD + ((frame_size) + PROTOCOL_LINK_OVERHEAD) / 254 + 2)
+
+typedef struct ProtocolLink {
+    byte     expected; // sequence number of the next frame to take
+    byte     errors;   // frames thrown away, wraps
+    byte     echo [1 + PROTOCOL_LINK_TEST_SIZE]; // link test frame to send back
+    byte     echo_size;
+    // byte by byte, see protocol_link_byte
+    byte     wire [PROTOCOL_WIRE_SIZE(PROTOCOL_MAX_FRAME_SIZE)];
+    uint16_t wire_size;
+    bool     wire_overflow;
+    byte     reply [PROTOCOL_STATUS_SIZE + 1 + PROTOCOL_LINK_TEST_SIZE];
+    byte     reply_size;
+    byte     reply_pos;
+} ProtocolLink;
+
+// Encoders return the number of bytes written
+size_t protocol_encode_global(byte* out, const MicrocontrollerGlobalState* global);
+size_t protocol_encode_generator(byte* out, ushort idx, bool reset_note_lifetime, const MicrocontrollerGeneratorState* state);
+size_t protocol_encode_generator_record(byte* out, ushort idx, bool reset_note_lifetime, const MicrocontrollerGeneratorState* state);
+size_t protocol_encode_envelope(byte* out, const Envelope* envelope);
+size_t protocol_patch_size(byte opcode);
+
+// Applies a whole frame to mirror, returns false if it is malformed, from another
+// protocol version or refers to a generator that doesn't exist
+bool protocol_decode_frame(const byte* data, size_t length, ProtocolMirror* mirror);
+
+// Called for every record right after it went into the mirror. opcode is the
+// PATCH_ one for what changed, a global state frame counts as its master volume,
+// envelope and every pitchwheel. index is the generator or channel.
+typedef void (*ProtocolApplied)(void* context, byte opcode, uint index, bool restart, const ProtocolMirror* mirror);
+// Same as protocol_decode_frame, telling applied about each record. Nothing is
+// applied or reported for a frame that doesn't decode.
+bool protocol_apply_frame(const byte* data, size_t length, ProtocolMirror* mirror, ProtocolApplied applied, void* context);
+
+uint16_t protocol_crc16(const byte* data, size_t length);
+size_t protocol_cobs_encode(const byte* in, size_t length, byte* out);
+size_t protocol_cobs_decode(const byte* in, size_t length, byte* out);
+size_t protocol_wrap(byte sequence, const byte* frame, size_t length, byte* out);
+size_t protocol_unwrap(const byte* wire, size_t length, byte* sequence, byte* frame);
+
+// The receiving end, what the FPGA does: takes one wire frame (without its 0 byte),
+// checks it and applies it to mirror if it is the next one. Returns whether it did.
+bool protocol_receive(ProtocolLink* link, const byte* wire, size_t length, ProtocolMirror* mirror);
+// The same a byte at a time, as it comes off the bus. Call protocol_link_select at
+// the start of each transfer, protocol_link_byte returns the byte shifted out while
+// in was shifted in. A zeroed ProtocolLink is ready to go.
+void protocol_link_select(ProtocolLink* link);
+byte protocol_link_byte(ProtocolLink* link, byte in, ProtocolMirror* mirror);
+
+#endif /* HEADERS_PROTOCOL_H_ */
@@ -9,16 +9,55 @@
 #define INCLUDES_EFM32_HEADERS_SPI_H_
 
 #include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "spidrv.h"
 #include "defines.h"
+#include "protocol.h"
 
 void TransferComplete( SPIDRV_Handle_t handle,
                        Ecode_t transferStatus,
                        int itemsTransferred );
 
+#define SPI_QUEUE_SIZE  16  // frames waiting to be sent or confirmed, power of two
+#define SPI_FRAME_SIZE  PROTOCOL_MAX_FRAME_SIZE
+#define SPI_WIRE_SIZE   PROTOCOL_WIRE_SIZE(SPI_FRAME_SIZE) // the same with the link layer around it
+#define SPI_MAX_POLLS   8   // status polls without progress before sending again
+#define SPI_MAX_RETRIES 4   // times sending again without progress before sending all state
+#define SPI_BITRATES { 100000, 250000, 500000, 1000000, 2000000, 4000000, 8000000 } // tried in this order
+#define SPI_QUALIFY_ROUNDS 16 // test patterns per bitrate, all of them have to come back right
+#define SPI_QUALIFY_MARGIN 1  // steps below the fastest bitrate that passed
+
+typedef struct SpiStats{
+	uint32_t frames_sent;
+	uint32_t frames_failed;
+	uint32_t queue_full;     // times spi_transmit had to wait for room
+	uint32_t frames_resent;  // sent again because the FPGA missed one
+	uint32_t status_missing; // transfers without a good status from the FPGA
+	uint32_t link_lost;      // times the FPGA fell behind what could be resent
+	uint32_t bitrate;          // picked by spi_qualify_bitrate
+	uint32_t link_tests;       // test patterns sent by it
+	uint32_t link_test_errors; // and how many didn't come back right
+} SpiStats;
+
 void spi_init(void);
+// Finds the fastest bitrate the FPGA echoes test patterns back at, and settles on
+// one a little below it. Blocks, for boot before anything else is sent.
+uint32_t spi_qualify_bitrate(void);
+
+// Queues the data and returns, TransferComplete sends the frames back to back.
+bool spi_transmit(const uint8_t* data, uint16_t data_size);
+// The same for count frames stored back to back in data, sizes[i] bytes each
+bool spi_transmit_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count);
+bool spi_idle(void);
+// Set when the FPGA lost frames that can't be resent anymore, the main loop then has
+// to send all state again, see microcontroller_resend_fpga_state
+bool spi_resync_pending(void);
+bool spi_take_resync(void);
+SpiStats spi_get_stats(void);
 
-// if you just want to forget about it, provide TransferComplete as callback.
-void spi_transmit(uint8_t* data, uint16_t data_size);
+#ifdef SPI_LOOPBACK
+const ProtocolMirror* spi_loopback_mirror(void); // what the stand-in FPGA has been told
+#endif
 
 #endif /* INCLUDES_EFM32_HEADERS_SPI_H_ */
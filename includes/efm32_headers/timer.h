@@ -11,4 +11,7 @@ void setupTimer(uint16_t delay);
 void pulse(void);
 bool setDone(void);
 
+void setupSampleClock(void);
+uint32_t sampleClockNow(void);
+
 #endif /* HEADERS_TIMER_H_ */
@@ -0,0 +1,56 @@
+#ifndef HEADERS_TRANSPORT_H_
+#define HEADERS_TRANSPORT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "defines.h"
+
+// How frames (see protocol.h) get to the FPGA, picked with FPGA_TRANSPORT in
+// defines.h. It's all decided at compile time, the calls below go straight to the
+// backend.
+//   transport_init()                        set up the bus
+//   transport_send(data, size)              queue one frame
+//   transport_send_burst(data, sizes, n)    queue n frames stored back to back, started together
+//   transport_busy()                        whether anything is still on its way
+//   transport_bitrate()                     bits per second the bus runs at, for budgeting it
+//   transport_take_resync()                 whether the FPGA lost state, and all of it has to be sent again
+#define TRANSPORT_SPI      1 // SPIDRV with DMA, spi.c
+#define TRANSPORT_EBI      2 // memory mapped registers, ebi.c
+#define TRANSPORT_LOOPBACK 3 // frames written to a file, for running on a PC, loopback.c
+
+#if FPGA_TRANSPORT == TRANSPORT_SPI
+#include "spi.h"
+static inline void transport_init(void) { spi_init(); }
+static inline bool transport_send(const uint8_t* data, uint16_t size) { return spi_transmit(data, size); }
+static inline bool transport_send_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count) { return spi_transmit_burst(data, sizes, count); }
+static inline bool transport_busy(void) { return !spi_idle(); }
+static inline uint32_t transport_bitrate(void) { return spi_get_stats().bitrate; }
+static inline bool transport_resync_pending(void) { return spi_resync_pending(); }
+static inline bool transport_take_resync(void) { return spi_take_resync(); }
+
+#elif FPGA_TRANSPORT == TRANSPORT_EBI
+#include "ebi.h"
+static inline void transport_init(void) { ebi_init(); }
+static inline bool transport_send(const uint8_t* data, uint16_t size) { return ebi_transmit(data, size); }
+static inline bool transport_send_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count) { return ebi_transmit_burst(data, sizes, count); }
+static inline bool transport_busy(void) { return false; }
+static inline uint32_t transport_bitrate(void) { return SPI_BITRATE; } // no bitrate, budgets as if on SPI
+static inline bool transport_resync_pending(void) { return false; }
+static inline bool transport_take_resync(void) { return false; }
+
+#elif FPGA_TRANSPORT == TRANSPORT_LOOPBACK
+#include "loopback.h"
+static inline void transport_init(void) { loopback_init(); }
+static inline bool transport_send(const uint8_t* data, uint16_t size) { return loopback_transmit(data, size); }
+static inline bool transport_send_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count) { return loopback_transmit_burst(data, sizes, count); }
+static inline bool transport_busy(void) { return false; }
+static inline uint32_t transport_bitrate(void) { return SPI_BITRATE; }
+static inline bool transport_resync_pending(void) { return false; }
+static inline bool transport_take_resync(void) { return false; }
+
+#else
+#error "FPGA_TRANSPORT has to be TRANSPORT_SPI, TRANSPORT_EBI or TRANSPORT_LOOPBACK"
+#endif
+
+#endif /* HEADERS_TRANSPORT_H_ */
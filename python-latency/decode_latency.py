@@ -0,0 +1,50 @@
+import struct
+import sys
+
+# Decodes the dump written by latencyDump() on the microcontroller, see latency.h
+MAGIC = 0x3154414C  # "LAT1"
+VERSION = 2  # LATENCY_DUMP_VERSION
+STAGES = ['usb -> parse', 'parse -> allocate', 'allocate -> spi queue', 'spi queue -> start', 'spi start -> done',
+          'total']
+
+
+def decode(data):
+    magic, version, n_stages, n_buckets, clock = struct.unpack_from('<IHBBI', data, 0)
+    if magic != MAGIC:
+        raise ValueError('not a latency dump')
+    if version != VERSION:
+        raise ValueError('latency dump version %d, this decodes version %d' % (version, VERSION))
+    offset = 12
+    stages = []
+    for i in range(n_stages):
+        count, low, high, total = struct.unpack_from('<IIIQ', data, offset)
+        offset += 20
+        buckets = struct.unpack_from('<%dI' % n_buckets, data, offset)
+        offset += 4 * n_buckets
+        name = STAGES[i] if i < len(STAGES) else 'stage %d' % i
+        stages.append((name, count, low, high, total, buckets))
+    return clock, stages
+
+
+def main(path):
+    with open(path, 'rb') as f:
+        clock, stages = decode(f.read())
+    us = 1e6 / clock  # per cycle
+    print('core clock %.1f MHz' % (clock / 1e6))
+    for name, count, low, high, total, buckets in stages:
+        if count == 0:
+            print('%-22s no samples' % name)
+            continue
+        print('%-22s n=%-8d min %9.1f us  mean %9.1f us  max %9.1f us'
+              % (name, count, low * us, total / count * us, high * us))
+        top = max(buckets)
+        for b, n in enumerate(buckets):
+            if n:
+                print('    < %10.1f us %8d %s' % ((2 << b) * us, n, '#' * max(1, 40 * n // top)))
+
+
+if __name__ == '__main__':
+    if len(sys.argv) != 2:
+        print('usage: decode_latency.py latency.bin')
+        sys.exit(1)
+    main(sys.argv[1])
@@ -0,0 +1,145 @@
+#include "transport.h"
+#if FPGA_TRANSPORT == TRANSPORT_EBI
+#include "latency.h"
+#include <string.h>
+#ifndef EBI_MEMORY
+#include "em_cmu.h"
+#include "em_ebi.h"
+#endif
+
+#ifdef EBI_MEMORY
+// No bus, the window is plain memory, for testing on a PC
+static uint16_t ebi_memory[EBI_WINDOW_REGS];
+static volatile uint16_t* window = ebi_memory;
+#else
+static volatile uint16_t* window;
+#endif
+
+static ProtocolMirror written; // what the registers hold
+static uint32_t frame_count = 0;
+static EbiStats ebi_stats = {0};
+
+void ebi_init(void)
+{
+#ifndef EBI_MEMORY
+	CMU_ClockEnable(cmuClock_EBI, true);
+	EBI_Init_TypeDef init = EBI_INIT_DEFAULT;
+	init.mode     = ebiModeD16;    // 16 bit data, address on its own lines
+	init.banks    = EBI_BANK0;
+	init.csLines  = EBI_CS0;
+	init.aLow     = ebiALowA0;
+	init.aHigh    = ebiAHighA8;    // enough for EBI_WINDOW_REGS
+	init.location = ebiLocation1;
+	// the FPGA latches on the strobe, a cycle either side is plenty
+	init.writeSetupCycles  = 1;
+	init.writeStrobeCycles = 1;
+	init.writeHoldCycles   = 1;
+	init.enable   = true;
+	EBI_Init(&init);
+	window = (volatile uint16_t*) EBI_BankAddress(EBI_BANK0);
+#endif
+	// the registers start out unknown, so write all of them once
+	memset(&written, 0, sizeof(written));
+	for (uint i = 0; i < EBI_WINDOW_REGS; i++)
+		window[i] = 0;
+}
+
+static void write_control(uint idx, bool restart)
+{
+	const MicrocontrollerGeneratorState* state = &written.generators[idx];
+	window[EBI_REG_GENERATOR(idx) + EBI_GENERATOR_CONTROL] = (state->enabled ? EBI_CONTROL_ENABLED : 0)
+		| (restart ? EBI_CONTROL_RESTART : 0) | (state->instrument << 8);
+	ebi_stats.stores++;
+}
+
+static void write_generator(uint idx, bool restart)
+{
+	const MicrocontrollerGeneratorState* state = &written.generators[idx];
+	volatile uint16_t* regs = window + EBI_REG_GENERATOR(idx);
+	regs[EBI_GENERATOR_NOTE]     = state->note_index | (state->channel_index << 8);
+	regs[EBI_GENERATOR_VELOCITY] = state->velocity;
+	ebi_stats.stores += 2;
+	write_control(idx, restart);
+}
+
+static void write_envelope(const Envelope* envelope)
+{
+	uint16_t regs[EBI_ENVELOPE_REGS] = {
+		envelope->attack & 0xFFFF, envelope->attack >> 16,
+		envelope->decay & 0xFFFF, envelope->decay >> 16,
+		(uint16_t) envelope->sustain,
+		envelope->release & 0xFFFF, envelope->release >> 16,
+	};
+	for (uint i = 0; i < EBI_ENVELOPE_REGS; i++)
+		window[EBI_REG_ENVELOPE + i] = regs[i];
+	ebi_stats.stores += EBI_ENVELOPE_REGS;
+}
+
+// Writes the registers for one record as it is decoded, written already holds it
+static void write_record(void* context, byte opcode, uint index, bool restart, const ProtocolMirror* mirror)
+{
+	(void) context;
+	switch (opcode) {
+		case PATCH_GENERATOR:
+			write_generator(index, restart);
+			break;
+		case PATCH_ENABLED:
+			write_control(index, false);
+			break;
+		case PATCH_VELOCITY:
+			window[EBI_REG_GENERATOR(index) + EBI_GENERATOR_VELOCITY] = mirror->generators[index].velocity;
+			ebi_stats.stores++;
+			break;
+		case PATCH_PITCHWHEEL:
+			window[EBI_REG_PITCHWHEEL(index)] = (uint16_t) (int16_t) mirror->global.pitchwheels[index];
+			ebi_stats.stores++;
+			break;
+		case PATCH_MASTER_VOLUME:
+			window[EBI_REG_MASTER_VOLUME] = mirror->global.master_volume;
+			ebi_stats.stores++;
+			break;
+		case PATCH_ENVELOPE:
+			write_envelope(&mirror->global.envelope);
+			break;
+	}
+}
+
+bool ebi_transmit(const uint8_t* data, uint16_t data_size)
+{
+	uint32_t started = latencyNow();
+	if (!protocol_apply_frame(data, data_size, &written, write_record, NULL)) {
+		ebi_stats.frames_bad++;
+		return false;
+	}
+	latencySpiQueued(frame_count);
+	latencySpiDone(frame_count, started, latencyNow());
+	frame_count++;
+	ebi_stats.frames++;
+	return true;
+}
+
+bool ebi_transmit_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count)
+{
+	bool all = true;
+	for (uint32_t i = 0; i < count; i++) {
+		all &= ebi_transmit(data, sizes[i]);
+		data += sizes[i];
+	}
+	return all;
+}
+
+bool ebi_idle(void)
+{
+	return true; // nothing is ever left to go out
+}
+
+EbiStats ebi_get_stats(void)
+{
+	return ebi_stats;
+}
+
+const volatile uint16_t* ebi_window(void)
+{
+	return window;
+}
+#endif
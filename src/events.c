@@ -0,0 +1,69 @@
+#include <stdatomic.h>
+#include "events.h"
+
+// Bounded multi producer, single consumer queue. Any interrupt can post, only the
+// main loop takes. Every slot has a sequence number telling whose turn it is: a
+// producer claims a position with a compare and swap on queue_head, fills in the
+// slot and then publishes it by bumping its sequence. An interrupt preempting
+// another one halfway just claims the next position, and the consumer stops at
+// the slot that isn't published yet until it is.
+// Sequences are kept minus the slot's index, so the zeroed queue is already empty
+// and interrupts can post before main gets around to anything.
+typedef struct EventSlot{
+	_Atomic uint32_t sequence;
+	Event event;
+} EventSlot;
+
+static EventSlot queue[EVENT_QUEUE_SIZE];
+static _Atomic uint32_t queue_head; // next position to claim
+static uint32_t queue_tail;   // next position to take, only touched by the consumer
+static _Atomic uint32_t dropped;
+
+static uint32_t loadSequence(uint32_t position){
+	return atomic_load_explicit(&queue[position % EVENT_QUEUE_SIZE].sequence, memory_order_acquire)
+		+ position % EVENT_QUEUE_SIZE;
+}
+
+static void storeSequence(uint32_t position, uint32_t sequence){
+	atomic_store_explicit(&queue[position % EVENT_QUEUE_SIZE].sequence,
+		sequence - position % EVENT_QUEUE_SIZE, memory_order_release);
+}
+
+bool postEvent(const Event* event){
+	uint32_t position = atomic_load_explicit(&queue_head, memory_order_relaxed);
+	EventSlot* slot;
+	for (;;) {
+		slot = &queue[position % EVENT_QUEUE_SIZE];
+		uint32_t sequence = loadSequence(position);
+		int32_t diff = (int32_t) (sequence - position);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue_head, &position, position + 1,
+					memory_order_relaxed, memory_order_relaxed))
+				break;
+		} else if (diff < 0) {
+			atomic_fetch_add_explicit(&dropped, 1, memory_order_relaxed); // full
+			return false;
+		} else {
+			position = atomic_load_explicit(&queue_head, memory_order_relaxed);
+		}
+	}
+	slot->event = *event;
+	storeSequence(position, position + 1);
+	return true;
+}
+
+bool takeEvent(Event* event){
+	if (loadSequence(queue_tail) != queue_tail + 1) return false;
+	*event = queue[queue_tail % EVENT_QUEUE_SIZE].event;
+	storeSequence(queue_tail, queue_tail + EVENT_QUEUE_SIZE);
+	queue_tail++;
+	return true;
+}
+
+bool hasEvent(void){
+	return loadSequence(queue_tail) == queue_tail + 1;
+}
+
+uint32_t getDroppedEvents(void){
+	return atomic_load_explicit(&dropped, memory_order_relaxed);
+}
@@ -1,57 +1,393 @@
 #include <stdio.h>
 #include "fpga.h"
-#include "spi.h"
 #include "input.h"
+#include "timer.h"
+#include "latency.h"
+#include "protocol.h"
+#include "transport.h"
+#include "em_common.h"
+#if defined(__ARM_FEATURE_DSP)
+#include "em_device.h" // for the Cortex-M4 SIMD intrinsics
+#endif
 
-uint find_unused_generator_id(MicrocontrollerGeneratorState** generator_states)
+// All generator and global state lives in this one statically allocated bank,
+// so RAM use is known at link time and nothing is ever malloc'd.
+static GeneratorBank generator_bank __attribute__((aligned(4))) = {
+	.global = {
+		.envelope = {
+			.attack  = SAMPLE_RATE / 100,
+			.decay   = SAMPLE_RATE / 10,
+			.sustain = 0x5FFF,
+			.release = SAMPLE_RATE / 4,
+		},
+	},
+};
+
+// Generator allocator: every generator sits in exactly one of two intrusive,
+// circular, doubly linked lists. The free list is kept in release order and the
+// active list in activation order (oldest first), so acquire, release and steal
+// are all constant time. The two extra slots after the generators are the list
+// heads, which means linking and unlinking never has to branch.
+#define FREE_LIST   N_GENERATORS
+#define ACTIVE_LIST (N_GENERATORS + 1)
+
+static GeneratorIndex generator_next[N_GENERATORS + 2];
+static GeneratorIndex generator_prev[N_GENERATORS + 2];
+
+// Occupancy bitmasks, one bit per generator. Set queries are answered a word
+// at a time with count-trailing-zeros (CLZ of the bit reversed word on the
+// Cortex-M), so they stay cheap for 64, 128 or 256 generators.
+static GeneratorMask generator_free_mask;   // not playing a note
+static GeneratorMask generator_silent_mask; // not playing a note, and its release has finished
+
+static inline void mask_set(GeneratorMask mask, uint idx)
 {
-	uint idx = 0;
-	while (idx < N_GENERATORS && generator_states[idx]->enabled) idx++;
-	return idx;
+	mask[idx >> 5] |= 1u << (idx & 31);
+}
+
+static inline void mask_clear(GeneratorMask mask, uint idx)
+{
+	mask[idx >> 5] &= ~(1u << (idx & 31));
+}
+
+static inline bool mask_test(const GeneratorMask mask, uint idx)
+{
+	return (mask[idx >> 5] >> (idx & 31)) & 1;
+}
+
+static inline uint mask_find_first(const GeneratorMask mask)
+{
+	for (uint w = 0; w < GENERATOR_MASK_WORDS; w++)
+		if (mask[w]) return (w << 5) | SL_CTZ(mask[w]);
+	return N_GENERATORS;
+}
+
+static inline uint mask_find_next(const GeneratorMask mask, uint from)
+{
+	// the first set bit at or after from, wrapping around at the end
+	if (from >= N_GENERATORS) from = 0; // also tells the compiler w is in bounds
+	uint     w    = from >> 5;
+	uint32_t bits = mask[w] & (~0u << (from & 31));
+	for (uint n = 0; n <= GENERATOR_MASK_WORDS; n++) {
+		if (bits) return (w << 5) | SL_CTZ(bits);
+		w    = (w + 1 == GENERATOR_MASK_WORDS) ? 0 : w + 1;
+		bits = mask[w];
+	}
+	return N_GENERATORS;
+}
+
+// Channels whose sustain pedal (CC64) is down, and the generators the pedal is
+// holding after their key was released. Those are released together when the
+// pedal is lifted.
+static ushort        sustain_pedal_down = 0;
+static GeneratorMask generator_sustained_mask;
+
+// Reverse map from a playing note to its generator, N_GENERATORS when the note
+// has none.
+static GeneratorIndex note_generator[N_MIDI_CHANNELS][N_MIDI_KEYS];
+
+// Structure-of-arrays mirror of the generator bank, so scans can look at four
+// generators per word instead of picking bytes out of the packed wire structs.
+// The arrays are padded to whole words, the padding lanes are never enabled.
+#define GENERATOR_LANES ((N_GENERATORS + 3) & ~3)
+
+static NoteIndex    generator_note[GENERATOR_LANES]     __attribute__((aligned(4)));
+static ChannelIndex generator_channel[GENERATOR_LANES]  __attribute__((aligned(4)));
+static Velocity     generator_velocity[GENERATOR_LANES] __attribute__((aligned(4)));
+static byte         generator_enabled[GENERATOR_LANES]  __attribute__((aligned(4)));
+
+#define LANES(b) ((uint32_t)(b) * 0x01010101u)
+
+static inline uint32_t lanes_load(const byte* array, uint idx)
+{
+	uint32_t lanes;
+	memcpy(&lanes, &array[idx], sizeof(lanes)); // a single LDR, without breaking aliasing rules
+	return lanes;
+}
+
+static inline uint32_t lanes_sub_saturate(uint32_t a, uint32_t b)
+{
+	// a - b in each byte lane, clamped at zero. This needs no GE flags, unlike
+	// USUB8/SEL, so the compiler is free to schedule it.
+#if defined(__ARM_FEATURE_DSP)
+	return __UQSUB8(a, b);
+#else
+	uint32_t result = 0;
+	for (uint shift = 0; shift < 32; shift += 8) {
+		uint32_t x = (a >> shift) & 0xFF;
+		uint32_t y = (b >> shift) & 0xFF;
+		if (x > y) result |= (x - y) << shift;
+	}
+	return result;
+#endif
 }
 
-static uint generator_activation = 0; // Total number of generator activations
-static uint generator_activation_count[N_GENERATORS] = {0}; // Total count last time a generator was activated
+static inline uint lanes_first_zero(uint32_t lanes)
+{
+	// the index of the first zero lane, 4 if there is none
+	uint32_t zero = lanes_sub_saturate(LANES(1), lanes); // 1 in the zero lanes
+	return zero ? SL_CTZ(zero) >> 3 : 4;
+}
+
+// Only built for the policy that uses each, tests/bench_scans.c defines ALL_LANE_SCANS
+#if VOICE_STEAL_POLICY == STEAL_SAME_NOTE || defined(ALL_LANE_SCANS)
+static uint find_enabled_generator(NoteIndex note_index, uint channel_index)
+{
+	// the first enabled generator playing note_index, on channel_index unless that is N_MIDI_CHANNELS
+	uint32_t notes    = LANES(note_index);
+	uint32_t channels = LANES(channel_index);
+	for (uint idx = 0; idx < GENERATOR_LANES; idx += 4) {
+		uint32_t diff = (lanes_load(generator_note, idx) ^ notes)
+		              | (lanes_load(generator_enabled, idx) ^ LANES(1));
+		if (channel_index < N_MIDI_CHANNELS)
+			diff |= lanes_load(generator_channel, idx) ^ channels;
+		uint lane = lanes_first_zero(diff);
+		if (lane < 4) return idx + lane;
+	}
+	return N_GENERATORS;
+}
+#endif
+
+#if VOICE_STEAL_POLICY == STEAL_LOWEST_VELOCITY || defined(ALL_LANE_SCANS)
+static inline uint32_t lanes_enabled_velocity(uint idx)
+{
+	// velocities of four generators, disabled ones read as 0xFF
+	return lanes_load(generator_velocity, idx) | ~(lanes_load(generator_enabled, idx) * 0xFF);
+}
 
-uint find_longest_active_generator_id(){
-	uint id = 0;
-	uint lowest_count = (uint)-1;
-	for(uint i = 0; i < N_GENERATORS; i++){
-		if(generator_activation_count[i] < lowest_count){
-			lowest_count = generator_activation_count[i];
-			id = i;
+static uint find_lowest_velocity_generator(void)
+{
+	uint32_t lowest = LANES(0xFF);
+	for (uint idx = 0; idx < GENERATOR_LANES; idx += 4) {
+		uint32_t velocity = lanes_enabled_velocity(idx);
+		lowest -= lanes_sub_saturate(lowest, velocity); // min in each lane
+	}
+	lowest -= lanes_sub_saturate(lowest, lowest >> 16);
+	lowest -= lanes_sub_saturate(lowest, lowest >> 8);
+	Velocity velocity = lowest & 0xFF;
+	if (velocity == 0xFF) return N_GENERATORS; // nothing enabled
+
+	for (uint idx = 0; idx < GENERATOR_LANES; idx += 4) {
+		uint lane = lanes_first_zero(lanes_enabled_velocity(idx) ^ LANES(velocity));
+		if (lane < 4) return idx + lane;
+	}
+	return N_GENERATORS;
+}
+#endif
+
+// When each generator was last switched on and off, in samples. Together with
+// the envelope this tells us roughly how loud the FPGA is still playing it,
+// since a disabled generator keeps sounding until its release is over.
+// generator_silent_mask caches that a release has finished.
+static Time           generator_on_time[N_GENERATORS];
+static Time           generator_off_time[N_GENERATORS];
+
+#define FULL_AMPLITUDE 0x7FFF
+
+static inline uint held_amplitude(const Envelope* envelope, Time age)
+{
+	// a note still in its attack is on its way to full volume, count it as there already
+	if (age < envelope->attack) return FULL_AMPLITUDE;
+	age -= envelope->attack;
+	uint sustain = envelope->sustain > 0 ? envelope->sustain : 0;
+	if (age >= envelope->decay) return sustain;
+	return FULL_AMPLITUDE - (uint)((uint64_t)(FULL_AMPLITUDE - sustain) * age / envelope->decay);
+}
+
+static inline uint generator_amplitude(uint idx, Time now)
+{
+	// estimated loudness of a generator, scaled by its velocity
+	if (mask_test(generator_silent_mask, idx)) return 0;
+	const Envelope* envelope = &generator_bank.global.envelope;
+	uint level;
+	if (!mask_test(generator_free_mask, idx)) {
+		level = held_amplitude(envelope, now - generator_on_time[idx]);
+	} else {
+		Time since_release = now - generator_off_time[idx];
+		if (since_release >= envelope->release) {
+			mask_set(generator_silent_mask, idx);
+			return 0;
 		}
+		level = held_amplitude(envelope, generator_off_time[idx] - generator_on_time[idx]);
+		level = (uint)((uint64_t)level * (envelope->release - since_release) / envelope->release);
 	}
-	return id;
+	return level * generator_velocity[idx];
 }
 
-int find_vacant_generator_channel(MicrocontrollerGeneratorState** generator_states) {
-    // we need to assign notes to generators in a round-robin fashion to avoid
-    // overruling the generators which are still generating the release sound too much
+static inline void generator_map(uint idx, NoteIndex note_index, ChannelIndex channel_index, Velocity velocity)
+{
+	generator_note[idx]     = note_index;
+	generator_channel[idx]  = channel_index;
+	generator_velocity[idx] = velocity;
+	generator_enabled[idx]  = true;
+	mask_clear(generator_free_mask, idx);
+	mask_clear(generator_silent_mask, idx);
+	note_generator[channel_index][note_index] = idx;
+}
 
-    static int starting_pos = 0;
-    int pos = starting_pos;
-    while (generator_states[pos]->enabled) {
-        pos++;
-        if (pos >= N_GENERATORS) pos = 0;
-        if (pos == starting_pos) return -1;
+static inline void generator_unmap(uint idx)
+{
+	mask_set(generator_free_mask, idx);
+	mask_clear(generator_sustained_mask, idx);
+	generator_enabled[idx] = false;
+	note_generator[generator_channel[idx]][generator_note[idx]] = N_GENERATORS;
+}
 
-    }
+static inline void generator_unlink(uint idx)
+{
+	generator_next[generator_prev[idx]] = generator_next[idx];
+	generator_prev[generator_next[idx]] = generator_prev[idx];
+}
 
-    starting_pos = (pos+1) % N_GENERATORS;
-    return pos;
+static inline void generator_append(uint list, uint idx)
+{
+	uint tail = generator_prev[list];
+	generator_next[tail] = idx;
+	generator_prev[idx]  = tail;
+	generator_next[idx]  = list;
+	generator_prev[list] = idx;
 }
 
-uint find_specific_generator_id(NoteIndex note_index, uint channel_index, MicrocontrollerGeneratorState** generator_states)
+// Voice stealing policy, resolved at compile time so the hot path has no
+// indirect calls. pick_free_generator chooses among the free generators and
+// pick_victim_generator among the active ones once those have run out.
+#define FREE_CANDIDATES 4 // released generators pick_free_generator compares at most
+
+#if VOICE_STEAL_POLICY == STEAL_ROUND_ROBIN
+static uint round_robin_pos = 0;
+
+static inline uint round_robin_take(uint idx)
 {
-	uint idx = 0; // sound_generator_index
-	while (idx < N_GENERATORS && !(
-		generator_states[idx]->enabled
-		&& generator_states[idx]->note_index    == note_index
-		&& generator_states[idx]->channel_index == channel_index
-	)) idx++;
+	round_robin_pos = (idx + 1 == N_GENERATORS) ? 0 : idx + 1;
 	return idx;
 }
+#endif
+
+static inline uint pick_free_generator(void)
+{
+	if (generator_next[FREE_LIST] == FREE_LIST) return N_GENERATORS; // out of generators
+#if VOICE_STEAL_POLICY == STEAL_ROUND_ROBIN
+	// we need to assign notes to generators in a round-robin fashion to avoid
+	// overruling the generators which are still generating the release sound too much
+	return round_robin_take(mask_find_next(generator_free_mask, round_robin_pos));
+#else
+	// prefer a generator whose release is known to have finished, then the one
+	// released the longest time ago if it has gone quiet since, else the quietest
+	// of the FREE_CANDIDATES released longest ago. Those are the furthest into their
+	// release, the ones after them are rarely quieter and not worth the walk.
+	uint idx = mask_find_first(generator_silent_mask);
+	if (is_valid_generator_id(idx)) return idx;
+	Time now = sampleClockNow();
+	idx = generator_next[FREE_LIST];
+	uint quietest = idx;
+	uint lowest = generator_amplitude(idx, now);
+	uint candidates = FREE_CANDIDATES - 1;
+	for (idx = generator_next[idx]; lowest != 0 && candidates-- && idx != FREE_LIST; idx = generator_next[idx]) {
+		uint amplitude = generator_amplitude(idx, now);
+		if (amplitude < lowest) {
+			lowest   = amplitude;
+			quietest = idx;
+		}
+	}
+	return quietest;
+#endif
+}
+
+static inline uint pick_victim_generator(NoteIndex note_index)
+{
+	(void) note_index; // only STEAL_SAME_NOTE looks at it
+	uint oldest = generator_next[ACTIVE_LIST];
+	if (oldest == ACTIVE_LIST) return N_GENERATORS; // nothing to steal
+#if VOICE_STEAL_POLICY == STEAL_OLDEST
+	return oldest;
+#elif VOICE_STEAL_POLICY == STEAL_LOWEST_VELOCITY
+	return find_lowest_velocity_generator(); // the lowest index wins ties
+#elif VOICE_STEAL_POLICY == STEAL_RELEASED_FIRST
+	for (uint idx = oldest; idx != ACTIVE_LIST; idx = generator_next[idx])
+		if (mask_test(generator_sustained_mask, idx)) return idx; // its key is up, only the pedal holds it
+	return N_GENERATORS; // every active generator is a held key, drop the new note instead
+#elif VOICE_STEAL_POLICY == STEAL_SAME_NOTE
+	uint idx = find_enabled_generator(note_index, N_MIDI_CHANNELS); // same pitch on another channel
+	return is_valid_generator_id(idx) ? idx : oldest;
+#elif VOICE_STEAL_POLICY == STEAL_ROUND_ROBIN
+	return round_robin_take(round_robin_pos); // they are all active
+#elif VOICE_STEAL_POLICY == STEAL_QUIETEST
+	Time now = sampleClockNow();
+	uint victim = oldest;
+	uint lowest = generator_amplitude(oldest, now);
+	for (uint idx = generator_next[oldest]; idx != ACTIVE_LIST; idx = generator_next[idx]) {
+		uint amplitude = generator_amplitude(idx, now);
+		if (amplitude < lowest) { // the oldest wins ties
+			lowest = amplitude;
+			victim = idx;
+		}
+	}
+	return victim;
+#else
+#error "unknown VOICE_STEAL_POLICY"
+#endif
+}
+
+static void generator_allocator_init(void)
+{
+	generator_next[FREE_LIST]   = generator_prev[FREE_LIST]   = FREE_LIST;
+	generator_next[ACTIVE_LIST] = generator_prev[ACTIVE_LIST] = ACTIVE_LIST;
+	for (uint i = 0; i < N_GENERATORS; i++) {
+		generator_append(FREE_LIST, i);
+		mask_set(generator_free_mask, i);
+		mask_set(generator_silent_mask, i);
+	}
+	for (uint c = 0; c < N_MIDI_CHANNELS; c++)
+		for (uint n = 0; n < N_MIDI_KEYS; n++)
+			note_generator[c][n] = N_GENERATORS;
+}
+
+uint acquire_generator_id(NoteIndex note_index, ChannelIndex channel_index, Velocity velocity)
+{
+	uint idx = pick_free_generator();
+	if (!is_valid_generator_id(idx)) return N_GENERATORS; // out of generators
+	generator_unlink(idx);
+	generator_append(ACTIVE_LIST, idx);
+	generator_map(idx, note_index, channel_index, velocity);
+	generator_on_time[idx] = sampleClockNow();
+	return idx;
+}
+
+uint steal_generator_id(NoteIndex note_index, ChannelIndex channel_index, Velocity velocity)
+{
+	// the stolen generator becomes the newest one
+	uint idx = pick_victim_generator(note_index);
+	if (!is_valid_generator_id(idx)) return N_GENERATORS; // the policy would rather drop the note
+	generator_unlink(idx);
+	generator_append(ACTIVE_LIST, idx);
+	generator_unmap(idx);
+	generator_map(idx, note_index, channel_index, velocity);
+	generator_on_time[idx] = sampleClockNow();
+	return idx;
+}
+
+void retrigger_generator_id(uint idx, Velocity velocity)
+{
+	// the generator keeps its note, but counts as the newest one again
+	generator_unlink(idx);
+	generator_append(ACTIVE_LIST, idx);
+	generator_velocity[idx] = velocity;
+	generator_on_time[idx]  = sampleClockNow();
+	mask_clear(generator_sustained_mask, idx);
+}
+
+void release_generator_id(uint idx)
+{
+	generator_unlink(idx);
+	generator_append(FREE_LIST, idx);
+	generator_unmap(idx);
+	generator_off_time[idx] = sampleClockNow();
+}
+
+uint find_specific_generator_id(NoteIndex note_index, ChannelIndex channel_index)
+{
+	return note_generator[channel_index][note_index];
+}
 
 byte is_valid_generator_id(uint idx)
 {
@@ -60,7 +396,6 @@ byte is_valid_generator_id(uint idx)
 
 void update_generator_state(MicrocontrollerGeneratorState* generator_state, bool enabled, NoteIndex note_index, uint channel_index, Velocity velocity)
 {
-	generator_activation++;
 	generator_state->enabled = enabled;
 	generator_state->note_index = note_index;
 	generator_state->channel_index = channel_index;
@@ -68,7 +403,154 @@ void update_generator_state(MicrocontrollerGeneratorState* generator_state, bool
 	generator_state->instrument = getInstrumentValue();
 }
 
-void handleMIDIEvent(MIDI_packet* m, MicrocontrollerGeneratorState** generator_states) {
+typedef struct PendingNote {
+	NoteIndex    note;
+	ChannelIndex channel;
+	Velocity     velocity;
+	Time         queued_at;
+	bool         released; // its key came up while the pedal was down, so only the pedal wants it
+} PendingNote;
+
+// Note-ons waiting for a generator, oldest first
+static PendingNote pending_notes[PENDING_NOTE_QUEUE_SIZE];
+static uint        pending_count = 0;
+
+static GeneratorStats generator_stats = {0};
+
+const GeneratorStats* get_generator_stats(void)
+{
+	return &generator_stats;
+}
+
+const GeneratorBank* get_generator_bank(void)
+{
+	return &generator_bank;
+}
+
+static uint find_pending_note(NoteIndex note, ChannelIndex channel)
+{
+	for (uint i = 0; i < pending_count; i++)
+		if (pending_notes[i].note == note && pending_notes[i].channel == channel) return i;
+	return pending_count;
+}
+
+static void remove_pending_note(uint i)
+{
+	pending_count--;
+	memmove(&pending_notes[i], &pending_notes[i+1], (pending_count - i) * sizeof(PendingNote));
+}
+
+// Drops the waiting notes older than PENDING_NOTE_MAX_AGE. Not only from the front,
+// a note-on for a note that is already waiting restarts its wait in place.
+static void expire_pending_notes(Time now)
+{
+	for (uint i = pending_count; i-- > 0; ) {
+		if (now - pending_notes[i].queued_at <= PENDING_NOTE_MAX_AGE) continue;
+		remove_pending_note(i);
+		generator_stats.notes_expired++;
+	}
+}
+
+static void queue_pending_note(NoteIndex note, ChannelIndex channel, Velocity velocity)
+{
+	Time now = sampleClockNow();
+	expire_pending_notes(now); // so stale notes can't keep a fresh one out
+	uint i = find_pending_note(note, channel);
+	if (i == pending_count) { // not already waiting
+		if (pending_count == PENDING_NOTE_QUEUE_SIZE) {
+			generator_stats.notes_dropped++;
+			return;
+		}
+		pending_count++;
+		generator_stats.notes_queued++;
+	}
+	pending_notes[i].note      = note;
+	pending_notes[i].channel   = channel;
+	pending_notes[i].velocity  = velocity;
+	pending_notes[i].queued_at = now;
+	pending_notes[i].released  = false;
+}
+
+static void start_pending_notes(void)
+{
+	expire_pending_notes(sampleClockNow());
+	while (pending_count) {
+		PendingNote pending = pending_notes[0];
+		uint idx = acquire_generator_id(pending.note, pending.channel, pending.velocity);
+		if (!is_valid_generator_id(idx)) return;
+		remove_pending_note(0);
+		generator_stats.notes_late++;
+		if (pending.released) mask_set(generator_sustained_mask, idx); // the pedal is still down, or it would be gone
+		update_generator_state(&generator_bank.generators[idx], true, pending.note, pending.channel, pending.velocity);
+		microcontroller_send_generator_update(idx, true);
+	}
+}
+
+void generator_bank_init(void)
+{
+	generator_allocator_init();
+	microcontroller_forget_fpga_state();
+	microcontroller_send_global_state_update(); // so the FPGA has the envelope from the start
+}
+
+// Key pressure can only swell a note above the velocity it was struck with
+static void apply_pressure(uint idx, byte pressure)
+{
+	MicrocontrollerGeneratorState* state = &generator_bank.generators[idx];
+	Velocity velocity = pressure > generator_velocity[idx] ? pressure : generator_velocity[idx];
+	if (!state->enabled || state->velocity == velocity) return;
+	state->velocity = velocity;
+	microcontroller_send_generator_update(idx, false);
+}
+
+static void release_generator(uint idx, Velocity velocity)
+{
+	NoteIndex    note    = generator_note[idx];
+	ChannelIndex channel = generator_channel[idx];
+
+	release_generator_id(idx);
+	update_generator_state(&generator_bank.generators[idx], false, note, channel, velocity);
+	microcontroller_send_generator_update(idx, false);
+	start_pending_notes();
+}
+
+static void release_note(NoteIndex note, ChannelIndex channel, Velocity velocity)
+{
+	uint idx = find_specific_generator_id(note, channel);
+	if (!is_valid_generator_id(idx)) { // none found, the note-on may still be waiting for a generator
+		uint i = find_pending_note(note, channel);
+		if (i == pending_count) return;
+		if (sustain_pedal_down & (1u << channel)) pending_notes[i].released = true; // gone when the pedal is lifted
+		else                                      remove_pending_note(i);
+		return;
+	}
+
+	if (sustain_pedal_down & (1u << channel)) { // the pedal keeps it sounding until it is lifted
+		mask_set(generator_sustained_mask, idx);
+		return;
+	}
+	release_generator(idx, velocity);
+}
+
+static void release_sustained_notes(ChannelIndex channel)
+{
+	// the pedal was lifted, let go of everything it held in a single SPI transfer
+	sustain_pedal_down &= ~(1u << channel);
+	for (uint i = pending_count; i-- > 0; ) // notes still waiting whose key is already up
+		if (pending_notes[i].channel == channel && pending_notes[i].released) remove_pending_note(i);
+	microcontroller_begin_batch();
+	for (uint w = 0; w < GENERATOR_MASK_WORDS; w++) {
+		uint32_t bits = generator_sustained_mask[w];
+		while (bits) {
+			uint idx = (w << 5) | SL_CTZ(bits);
+			bits &= bits - 1;
+			if (generator_channel[idx] == channel) release_generator(idx, 0);
+		}
+	}
+	microcontroller_end_batch();
+}
+
+void handleMIDIEvent(MIDI_packet* m) {
 	char converted[7];
 
 	for(int i=0; i < 3; i++) {
@@ -90,13 +572,10 @@ void handleMIDIEvent(MIDI_packet* m, MicrocontrollerGeneratorState** generator_s
             Velocity       velocity = m->data[2];
 
             if (channel == 9) return; // ignore drums
+            if (note >= N_MIDI_KEYS) return; // malformed packet
 
-            // find the sound generator currenty playing this note
-			uint idx = find_specific_generator_id(note, channel, generator_states);
-			if (!is_valid_generator_id(idx)) return; // none found, probably due to the note-on being ignored due to lack of generators
-
-			update_generator_state(generator_states[idx], false, note, channel, velocity);
-			microcontroller_send_generator_update(idx, false, generator_states);
+            // release the sound generator currenty playing this note
+			release_note(note, channel, velocity);
         }
         break; case 0b1001: { // note-on event
             //assert(length == 3);
@@ -106,77 +585,346 @@ void handleMIDIEvent(MIDI_packet* m, MicrocontrollerGeneratorState** generator_s
 
             if (channel == 9) return; // ignore drums
             if (velocity == 0) goto note_off_event; // people suck at following the midi standard
-
-            // find vacant sound generator
-			uint idx = find_unused_generator_id(generator_states); // sound_generator_index
-			if (!is_valid_generator_id(idx)) { // out of generators, ignore
+            if (note >= N_MIDI_KEYS) return; // malformed packet
+
+			uint idx = find_specific_generator_id(note, channel); // sound_generator_index
+			if (is_valid_generator_id(idx)) {
+				// a retrigger of a note that is still held or sustained, restart the generator
+				// it already has so that repeated notes never use up more than one
+				retrigger_generator_id(idx, velocity);
+			} else {
+				// find vacant sound generator
+				idx = acquire_generator_id(note, channel, velocity);
+				if (!is_valid_generator_id(idx)) { // out of generators
 #ifdef OVERRIDE_ON_FULL
-				idx = find_longest_active_generator_id();
+					idx = steal_generator_id(note, channel, velocity);
+					if (is_valid_generator_id(idx)) generator_stats.notes_stolen++;
 #endif
+				}
+				if (!is_valid_generator_id(idx)) { // nothing to steal either, wait for a generator to free up
+					queue_pending_note(note, channel, velocity);
+					return;
+				}
+			}
+
+			update_generator_state(&generator_bank.generators[idx], true, note, channel, velocity);
+			microcontroller_send_generator_update(idx, true);
+        }
+        break; case 0b1010: { // Polyphonic Key Pressure (Aftertouch) event
+            ChannelIndex channel = packet_info.type_specifier;
+            NoteIndex    note    = m->data[1];
+            if (note >= N_MIDI_KEYS) return; // malformed packet
+            uint idx = find_specific_generator_id(note, channel);
+            if (is_valid_generator_id(idx)) apply_pressure(idx, m->data[2]);
+        }
+        break; case 0b1011: { // Control Change event
+            ChannelIndex channel    = packet_info.type_specifier;
+            byte         controller = m->data[1];
+
+            if (controller == 64) { // sustain pedal
+                if (m->data[2] >= 64) sustain_pedal_down |= 1u << channel;
+                else                  release_sustained_notes(channel);
+            } else if (controller == 123) { // all notes off, the pedal still holds them
+                microcontroller_begin_batch();
+                for (uint note = 0; note < N_MIDI_KEYS; note++)
+                    release_note(note, channel, 0);
+                microcontroller_end_batch();
+            } else if (controller == 120) { // all sound off, pedal or not
+                microcontroller_begin_batch();
+                for (uint note = 0; note < N_MIDI_KEYS; note++) {
+                    uint idx = find_specific_generator_id(note, channel);
+                    if (is_valid_generator_id(idx)) release_generator(idx, 0);
+                }
+                microcontroller_end_batch();
             }
-
-			update_generator_state(generator_states[idx], true, note, channel, velocity);
-			microcontroller_send_generator_update(idx, true, generator_states);
-			generator_activation_count[idx] = generator_activation;
         }
-        break; case 0b1010:  // Polyphonic Key Pressure (Aftertouch) event
-        break; case 0b1011:  // Control Change event
         break; case 0b1100:  // Program Chang event
-        break; case 0b1101:  // Channel Pressure (After-touch) event
+        break; case 0b1101: { // Channel Pressure (After-touch) event
+            ChannelIndex channel = packet_info.type_specifier;
+            microcontroller_begin_batch();
+            for (uint idx = 0; idx < N_GENERATORS; idx++)
+                if (generator_channel[idx] == channel) apply_pressure(idx, m->data[1]);
+            microcontroller_end_batch();
+        }
         break; case 0b1110: { // Pitch Bend Change event
-        	Pitch pitch = m->data[2];
+            // 14 bits centered on 0x2000, the FPGA gets the top 8 as a signed offset
+            ChannelIndex channel = packet_info.type_specifier;
+            int bend = (m->data[1] | (m->data[2] << 7)) - 0x2000;
+            generator_bank.global.pitchwheels[channel] = (sbyte) (bend >> 6);
+            microcontroller_send_global_state_update();
         }
         break; case 0b1111:  // System Exclusive event
         break; default: break;         // unknown - ignored
     }
 }
 
-void microcontroller_send_global_state_update(const MicrocontrollerGlobalState* global_state)
-{
-	byte data[1 + sizeof(MicrocontrollerGlobalState)]; // TODO remove the +1, its so we have room for a null byte
+// What the FPGA was last sent, so that only what changed has to go out again. Its
+// state after reset is unknown, so everything starts out unknown and is sent in full.
+static MicrocontrollerGeneratorState fpga_generators[N_GENERATORS];
+static MicrocontrollerGlobalState    fpga_global;
+static GeneratorMask                 fpga_generator_known;
+static bool                          fpga_global_known = false;
 
-	data[0] = 1; // global_state update
+static SpiUpdateStats spi_update_stats = {0};
 
-	memcpy(data+1, global_state, sizeof(MicrocontrollerGlobalState));
+// Once the link has reset, the FPGA lost frames that can't be resent and nothing it
+// was sent can be assumed. Until the main loop has resent everything, each update
+// goes out in full.
+static void forget_on_link_reset(void)
+{
+	if (transport_resync_pending()) microcontroller_forget_fpga_state();
+}
 
-	spi_transmit((byte*)data, sizeof(data));
+// Updates are collected here as records of a FRAME_PATCH frame, and sent when the
+// outermost batch ends, or right away when not batching.
+static byte patch_frame[PROTOCOL_MAX_FRAME_SIZE];
+static uint patch_size  = PATCH_HEADER_SIZE;
+static uint patch_count = 0;
+static uint patch_batch_depth = 0; // batches can nest, only the outermost one sends
+
+// Frames finished inside a batch wait here and go to the transport together as one
+// burst when it ends, or when this fills up
+#define BURST_FRAMES 4
+static byte     burst_data[BURST_FRAMES * PROTOCOL_MAX_FRAME_SIZE];
+static uint16_t burst_sizes[BURST_FRAMES];
+static uint     burst_size  = 0;
+static uint     burst_count = 0;
+
+static void send_burst(void)
+{
+	if (burst_count == 0) return;
+	transport_send_burst(burst_data, burst_sizes, burst_count);
+	burst_size  = 0;
+	burst_count = 0;
 }
 
-void microcontroller_send_generator_update(ushort generator_index, bool reset_note_lifetime, const MicrocontrollerGeneratorState** generator_states)
+static void send_frame(const byte* data, uint size)
 {
-	 // set reset_note_lifetime to true when sending note-on events
-	byte data[2 + sizeof(ushort) + sizeof(MicrocontrollerGeneratorState)]; // TODO remove the +1, its so we have room for a null byte
+	spi_update_stats.frames++;
+	spi_update_stats.bytes += size;
+	if (patch_batch_depth == 0) {
+		transport_send(data, size);
+		return;
+	}
+	if (burst_count == BURST_FRAMES) send_burst();
+	memcpy(burst_data + burst_size, data, size);
+	burst_sizes[burst_count++] = size;
+	burst_size += size;
+}
 
-	data[0] = 1; // here comes a package
+static void flush_patch_frame(void)
+{
+	if (patch_count == 0) return;
+	if (patch_count == 1 && patch_frame[2] == PATCH_GENERATOR) {
+		// a lone full update goes out as the shorter FRAME_GENERATOR, same layout
+		patch_frame[2] = PROTOCOL_HEADER(FRAME_GENERATOR);
+		send_frame(patch_frame + 2, patch_size - 2);
+	} else {
+		patch_frame[0] = PROTOCOL_HEADER(FRAME_PATCH);
+		patch_frame[1] = patch_count;
+		send_frame(patch_frame, patch_size);
+	}
+	patch_size  = PATCH_HEADER_SIZE;
+	patch_count = 0;
+}
 
-	*(ushort*)(&data[1]) = generator_index;
-	data[3] = (byte) reset_note_lifetime;
+// Room for a record of size bytes, flushing first if it doesn't fit
+static byte* append_patch(byte opcode, uint size)
+{
+	if (patch_size + size > sizeof(patch_frame) || patch_count == 0xFF) flush_patch_frame();
+	byte* record = patch_frame + patch_size;
+	record[0] = opcode;
+	patch_size += size;
+	patch_count++;
+	spi_update_stats.records++;
+	return record + 1;
+}
 
-	memcpy(data+3+sizeof(ushort), generator_states[generator_index], sizeof(MicrocontrollerGeneratorState));
+static void patch_generator(ushort idx, bool reset_note_lifetime)
+{
+	byte* data = append_patch(PATCH_GENERATOR, PATCH_GENERATOR_SIZE);
+	protocol_encode_generator_record(data, idx, reset_note_lifetime, &generator_bank.generators[idx]);
+}
 
-	spi_transmit((byte*)data, sizeof(data));
+static void patch_generator_field(byte opcode, ushort idx, byte value)
+{
+	byte* data = append_patch(opcode, PATCH_FIELD_SIZE);
+	data[0] = idx & 0xFF;
+	data[1] = idx >> 8;
+	data[2] = value;
 }
 
-// TODO write code to free these structs, or else we will all suffer
-MicrocontrollerGeneratorState* generator_state_new() {
-	MicrocontrollerGeneratorState* generator_state = malloc(sizeof(MicrocontrollerGeneratorState));
-	generator_state->channel_index = 0;
-	generator_state->enabled = false;
-	// TODO give reasonable defaultvalues here. i am lazy.
-	generator_state->instrument = 0;
-	generator_state->note_index = 0;
-	generator_state->velocity = 0;
-	return generator_state;
+void microcontroller_begin_batch(void)
+{
+	patch_batch_depth++;
+}
 
+void microcontroller_end_batch(void)
+{
+	if (patch_batch_depth == 0) return;
+	if (patch_batch_depth == 1) {
+		flush_patch_frame(); // still batching, so it joins the burst
+		send_burst();
+	}
+	patch_batch_depth--;
 }
 
-MicrocontrollerGlobalState* global_state_new(void) {
-	MicrocontrollerGlobalState* global_state = malloc(sizeof(MicrocontrollerGlobalState));
-	global_state->master_volume = 0;
-	// TODO give reasonable default values here. i am lazy.
-	global_state->envelope = NULL;
+// The updates themselves. The public functions below are what event handling calls
+// and mark the latency trace, the refresh and the resend aren't part of an event.
+static void send_global_state(void)
+{
+	forget_on_link_reset();
+	const MicrocontrollerGlobalState* global = &generator_bank.global;
+
+	uint changed_wheels = 0;
 	for (uint i = 0; i < N_MIDI_CHANNELS; i++)
-		global_state->pitchwheels[i] = 0;
-	return global_state;
+		changed_wheels += global->pitchwheels[i] != fpga_global.pitchwheels[i];
+	bool changed_volume = global->master_volume != fpga_global.master_volume;
+	bool changed_envelope = memcmp(&global->envelope, &fpga_global.envelope, sizeof(Envelope)) != 0;
+	uint patch_bytes = changed_wheels * PATCH_PITCHWHEEL_SIZE + changed_volume * PATCH_MASTER_VOLUME_SIZE
+		+ changed_envelope * PATCH_ENVELOPE_SIZE;
+
+	if (!fpga_global_known || patch_bytes >= PROTOCOL_GLOBAL_SIZE) {
+		flush_patch_frame(); // keep the frames in order
+		byte data[PROTOCOL_GLOBAL_SIZE];
+		protocol_encode_global(data, global);
+		send_frame(data, sizeof(data));
+	} else if (patch_bytes == 0) {
+		spi_update_stats.skipped++;
+		return;
+	} else {
+		if (changed_volume)
+			append_patch(PATCH_MASTER_VOLUME, PATCH_MASTER_VOLUME_SIZE)[0] = global->master_volume;
+		if (changed_envelope)
+			protocol_encode_envelope(append_patch(PATCH_ENVELOPE, PATCH_ENVELOPE_SIZE), &global->envelope);
+		for (uint i = 0; i < N_MIDI_CHANNELS; i++) {
+			if (global->pitchwheels[i] == fpga_global.pitchwheels[i]) continue;
+			byte* data = append_patch(PATCH_PITCHWHEEL, PATCH_PITCHWHEEL_SIZE);
+			data[0] = i;
+			data[1] = (byte) global->pitchwheels[i];
+		}
+		if (patch_batch_depth == 0) flush_patch_frame();
+	}
+	fpga_global = *global;
+	fpga_global_known = true;
 }
 
+static void send_generator_update(ushort generator_index, bool reset_note_lifetime)
+{
+	forget_on_link_reset();
+	const MicrocontrollerGeneratorState* state  = &generator_bank.generators[generator_index];
+	MicrocontrollerGeneratorState*       shadow = &fpga_generators[generator_index];
+
+	if (reset_note_lifetime || !mask_test(fpga_generator_known, generator_index)
+			|| state->instrument != shadow->instrument || state->note_index != shadow->note_index
+			|| state->channel_index != shadow->channel_index) {
+		patch_generator(generator_index, reset_note_lifetime);
+	} else if (state->enabled == shadow->enabled && state->velocity == shadow->velocity) {
+		spi_update_stats.skipped++;
+		return;
+	} else {
+		if (state->enabled != shadow->enabled)
+			patch_generator_field(PATCH_ENABLED, generator_index, state->enabled);
+		if (state->velocity != shadow->velocity)
+			patch_generator_field(PATCH_VELOCITY, generator_index, state->velocity);
+	}
+	*shadow = *state;
+	mask_set(fpga_generator_known, generator_index);
+	if (patch_batch_depth == 0) flush_patch_frame();
+}
+
+void microcontroller_send_global_state_update(void)
+{
+	latencyMark(LATENCY_ALLOCATED);
+	send_global_state();
+}
+
+void microcontroller_send_generator_update(ushort generator_index, bool reset_note_lifetime)
+{
+	 // set reset_note_lifetime to true when sending note-on events
+	latencyMark(LATENCY_ALLOCATED);
+	send_generator_update(generator_index, reset_note_lifetime);
+}
+
+// Next time everything goes out in full, for when the FPGA may have lost its state
+void microcontroller_forget_fpga_state(void)
+{
+	memset(fpga_generator_known, 0, sizeof(fpga_generator_known));
+	fpga_global_known = false;
+}
+
+// Sends the FPGA everything, for when it lost frames that can't be resent anymore
+void microcontroller_resend_fpga_state(void)
+{
+	microcontroller_forget_fpga_state();
+	microcontroller_begin_batch();
+	send_global_state();
+	for (ushort i = 0; i < N_GENERATORS; i++)
+		send_generator_update(i, false);
+	microcontroller_end_batch();
+}
+
+// Background refresh. Nothing else would ever put right an update the FPGA missed,
+// so what it was last sent goes out again one record at a time, round-robin. Only
+// when the SPI queue is empty, so notes never wait behind it, and only within
+// REFRESH_BUS_SHARE percent of the bus at the bitrate it actually runs at. A whole
+// round takes about REFRESH_ROUND_BYTES / refresh_bytes_per_second() seconds.
+#define REFRESH_WIRE_SIZE(size)  PROTOCOL_WIRE_SIZE(size)
+#define REFRESH_ROUND_BYTES      (N_GENERATORS * REFRESH_WIRE_SIZE(PROTOCOL_GENERATOR_SIZE) \
+                                  + REFRESH_WIRE_SIZE(PROTOCOL_GLOBAL_SIZE))
+// credit is counted in bytes times SAMPLE_RATE, enough to save up for the largest record
+#define REFRESH_CREDIT_MAX       (REFRESH_WIRE_SIZE(PROTOCOL_GLOBAL_SIZE) * SAMPLE_RATE)
+
+static uint     refresh_pos    = 0; // N_GENERATORS is the global state
+static uint32_t refresh_credit = 0;
+static Time     refresh_time   = 0;
+
+// The bitrate is only known once spi_qualify_bitrate has run, so this is worked out
+// every time. Never 0, the credit has to grow.
+static uint32_t refresh_bytes_per_second(void)
+{
+	uint32_t rate = transport_bitrate() / 8 * REFRESH_BUS_SHARE / 100;
+	return rate > 0 ? rate : 1;
+}
+
+// Sends the next record if there is room for it, returns whether it did
+bool microcontroller_refresh_fpga_state(void)
+{
+	Time now = sampleClockNow();
+	Time elapsed = now - refresh_time;
+	refresh_time = now;
+	uint32_t rate = refresh_bytes_per_second();
+	if (elapsed >= REFRESH_CREDIT_MAX / rate)
+		refresh_credit = REFRESH_CREDIT_MAX;
+	else
+		refresh_credit += elapsed * rate;
+	if (refresh_credit > REFRESH_CREDIT_MAX) refresh_credit = REFRESH_CREDIT_MAX;
+
+	if (patch_batch_depth > 0 || transport_busy()) return false;
+	bool global = refresh_pos == N_GENERATORS;
+	uint cost = REFRESH_WIRE_SIZE(global ? PROTOCOL_GLOBAL_SIZE : PROTOCOL_GENERATOR_SIZE) * SAMPLE_RATE;
+	if (refresh_credit < cost) return false;
+	refresh_credit -= cost;
+
+	if (global && fpga_global_known) {
+		byte data[PROTOCOL_GLOBAL_SIZE];
+		protocol_encode_global(data, &fpga_global);
+		send_frame(data, sizeof(data));
+	} else if (global) {
+		send_global_state();
+	} else if (mask_test(fpga_generator_known, refresh_pos)) {
+		byte data[PROTOCOL_GENERATOR_SIZE];
+		protocol_encode_generator(data, refresh_pos, false, &fpga_generators[refresh_pos]);
+		send_frame(data, sizeof(data));
+	} else {
+		send_generator_update(refresh_pos, false);
+	}
+	spi_update_stats.refreshed++;
+	refresh_pos = (refresh_pos + 1) % (N_GENERATORS + 1);
+	return true;
+}
+
+const SpiUpdateStats* get_spi_update_stats(void)
+{
+	return &spi_update_stats;
+}
@@ -10,7 +10,7 @@
 #include "bsp.h"
 #include "bsp_trace.h"
 #endif
-#include "input.h"
+#include "events.h"
 
 #ifdef DEVICE_GECKO_STARTER_KIT
 static unsigned int gpio_btn_index_to_pin[] = {
@@ -87,14 +87,17 @@ static bool button_state[GPIO_BTN_COUNT] = {0};
 
 static bool led_toggle = false; // debug
 
+// Runs in the GPIO interrupt, only samples the buttons and leaves the rest to the main loop
 void handleButtons()
 {
+    Event event = {.type = EVENT_BUTTONS, .buttons = 0};
     for(int i = 0; i < GPIO_BTN_COUNT; i++){
         button_state[i] = GPIO_PinInGet(gpio_btn_index_to_port[i], gpio_btn_index_to_pin[i]);
+        if (button_state[i]) event.buttons |= 1u << i;
     }
     led_toggle = !led_toggle;
     setExtLed(led_toggle);
-    handleMultipleButtonPresses();
+    postEvent(&event);
 }
 
 void pulse_reset() {
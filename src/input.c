@@ -13,6 +13,8 @@
 #include "usbhost.h"
 #include "defines.h"
 #include "fpga.h"
+#include "events.h"
+#include "latency.h"
 
 int octaveShiftValue = 0;
 int MIDI_channelValue = 0;
@@ -78,32 +80,62 @@ static int octave_shift_max = 3;
 // Yes this is ugly thank you
 static int button_is_on_keyboard[GPIO_BTN_COUNT] = {1, 1, 1, 1, 1, 1, 0, 1, 1, 1, 1, 1, 1, 0, 0, 0};
 
-MIDI_packet waitForInput(){
-	USB_output usb_out = USBWaitForData();
-	MIDI_packet midi_out;
-	midi_out.data[0] = usb_out.data[1];
-	midi_out.data[1] = usb_out.data[2];
-	midi_out.data[2] = usb_out.data[3];
-	return midi_out;
+// Takes everything the interrupts have posted and everything USB has received and
+// hands it to the generators. Returns how many events there were, 0 if it was idle.
+size_t processInput(void){
+	size_t count = 0;
+	Event event;
+	while (takeEvent(&event)) {
+		// everything one event causes goes out as one SPI burst
+		microcontroller_begin_batch();
+		if (event.type == EVENT_MIDI)
+			handleMIDIEvent(&event.midi);
+		else if (event.type == EVENT_BUTTONS)
+			handleMultipleButtonPresses(event.buttons);
+		microcontroller_end_batch();
+		count++;
+	}
+
+	// USB packets received so far, a few at a time so the buttons don't wait too long
+	size_t received = 0;
+	const unsigned char* data;
+	uint32_t arrival;
+	int length;
+	while (received < INPUT_MAX_EVENTS && (length = USBPeekPacket(&data, &arrival)) > 0) {
+		MIDI_packet input[USB_MAX_PACKET_SIZE / USB_MIDI_EVENT_SIZE];
+		latencyStart(arrival);
+		size_t decoded = MIDI_decode_USB_packet(data, length, input, sizeof(input) / sizeof(input[0]));
+		latencyMark(LATENCY_PARSED);
+		USBReleasePacket();
+		// a chord in one packet goes out as one SPI burst, so it's traced as one
+		microcontroller_begin_batch();
+		for (size_t i = 0; i < decoded; i++)
+			handleMIDIEvent(&input[i]);
+		microcontroller_end_batch();
+		latencyFinish();
+		received += decoded;
+	}
+	return count + received;
 }
 
-void handleMultipleButtonPresses(MicrocontrollerGeneratorState** generator_states){
+void handleMultipleButtonPresses(uint32_t buttons){
 	for(int i = 0; i < GPIO_BTN_COUNT; i++){
-		if(last_button_state[i] != isButtonDown(i)){
-			last_button_state[i] = isButtonDown(i);
+		bool down = (buttons >> i) & 1;
+		if(last_button_state[i] != down){
+			last_button_state[i] = down;
 			if(button_is_on_keyboard[i]){ // Handle buttonkeyboard events
 				MIDI_packet packet_to_send;
-				if(isButtonDown(i))
+				if(down)
                     packet_to_send = keydown_to_midi[i];
 				else
 					packet_to_send = keyup_to_midi[i];
 
 				// Change octave of packet
 				packet_to_send.data[1] += octave_shift * NOTES_IN_OCTAVE;
-                handleMIDIEvent(&packet_to_send, generator_states);
+                handleMIDIEvent(&packet_to_send);
 			}
 			else{ // Handle buttonmenu events
-				if(isButtonDown(i)){
+				if(down){
 					if(i == CHANGE_INSTRUMENT_BUTTON){
 						// Change instrument
 						if(instrumentValue <= 3)
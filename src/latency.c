@@ -0,0 +1,182 @@
+#include "latency.h"
+
+#if LATENCY_STATS
+#include "em_device.h"
+#include "em_cmu.h"
+
+static LatencyStage stages[N_LATENCY_STAGES];
+
+typedef struct LatencyTrace{
+	uint32_t time[N_LATENCY_POINTS];
+	uint32_t reached; // bit per point
+} LatencyTrace;
+
+// The event being traced, one at a time since only the main loop handles them
+static LatencyTrace trace;
+static bool tracing = false;
+
+// Traces waiting for their SPI frame, indexed by frame number. The main loop parks
+// them before the frame can start, the SPI interrupt fills in the last two points.
+#define N_PARKED_TRACES 16 // power of two, at least the SPI queue size
+typedef enum ParkedState{ PARKED_FREE, PARKED_WAITING, PARKED_DONE } ParkedState;
+typedef struct ParkedTrace{
+	LatencyTrace trace;
+	uint32_t frame;
+	volatile ParkedState state;
+} ParkedTrace;
+static ParkedTrace parked[N_PARKED_TRACES];
+
+uint8_t latency_snapshot[LATENCY_DUMP_SIZE];
+
+void latencyInit(void)
+{
+	// DWT cycle counter, there on both the M3 and the M4
+	CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+	DWT->CYCCNT = 0;
+	DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+	latencyReset();
+}
+
+uint32_t latencyNow(void)
+{
+	return DWT->CYCCNT;
+}
+
+void latencyReset(void)
+{
+	for (unsigned int i = 0; i < N_LATENCY_STAGES; i++) {
+		stages[i] = (LatencyStage) {.min = UINT32_MAX};
+	}
+	tracing = false;
+	for (unsigned int i = 0; i < N_PARKED_TRACES; i++) parked[i].state = PARKED_FREE;
+}
+
+void latencyStart(uint32_t arrival)
+{
+	tracing = true;
+	trace.reached = 0;
+	latencyMarkAt(LATENCY_USB_DONE, arrival);
+}
+
+void latencyMarkAt(LatencyPoint point, uint32_t time)
+{
+	// only the first time an event gets there counts, later SPI transfers for the
+	// same event are part of the same trip
+	if (!tracing || (trace.reached & (1u << point))) return;
+	trace.time[point] = time;
+	trace.reached |= 1u << point;
+}
+
+void latencyMark(LatencyPoint point)
+{
+	if (!tracing) return;
+	latencyMarkAt(point, latencyNow());
+}
+
+static void record(LatencyStage* stage, uint32_t cycles)
+{
+	stage->count++;
+	stage->sum += cycles;
+	if (cycles < stage->min) stage->min = cycles;
+	if (cycles > stage->max) stage->max = cycles;
+	unsigned int bucket = cycles ? 31 - __CLZ(cycles) : 0;
+	stage->buckets[bucket]++;
+}
+
+static void recordTrace(const LatencyTrace* t)
+{
+	// an event that never reaches SPI (a note-off held by the pedal) only fills in
+	// the stages it got through
+	for (unsigned int i = 0; i + 1 < N_LATENCY_POINTS; i++) {
+		uint32_t both = (1u << i) | (1u << (i + 1));
+		if ((t->reached & both) == both)
+			record(&stages[i], t->time[i + 1] - t->time[i]);
+	}
+	uint32_t ends = (1u << LATENCY_USB_DONE) | (1u << LATENCY_SPI_DONE);
+	if ((t->reached & ends) == ends)
+		record(&stages[LATENCY_TOTAL], t->time[LATENCY_SPI_DONE] - t->time[LATENCY_USB_DONE]);
+}
+
+void latencyFinish(void)
+{
+	if (!tracing) return;
+	tracing = false;
+	// parked ones are recorded by latencyCollect once their frame is out
+	if (!(trace.reached & (1u << LATENCY_SPI_QUEUED)))
+		recordTrace(&trace);
+	latencyCollect();
+}
+
+// Called by the SPI queue right before the frame becomes visible to the interrupt
+void latencySpiQueued(uint32_t frame)
+{
+	if (!tracing || (trace.reached & (1u << LATENCY_SPI_QUEUED))) return;
+	ParkedTrace* p = &parked[frame % N_PARKED_TRACES];
+	if (p->state != PARKED_FREE) return; // not collected yet, let this one go
+	latencyMark(LATENCY_SPI_QUEUED);
+	p->trace = trace;
+	p->frame = frame;
+	p->state = PARKED_WAITING;
+}
+
+// Runs in the SPI interrupt
+void latencySpiDone(uint32_t frame, uint32_t started, uint32_t finished)
+{
+	ParkedTrace* p = &parked[frame % N_PARKED_TRACES];
+	if (p->state != PARKED_WAITING || p->frame != frame) return;
+	p->trace.time[LATENCY_SPI_START] = started;
+	p->trace.time[LATENCY_SPI_DONE] = finished;
+	p->trace.reached |= (1u << LATENCY_SPI_START) | (1u << LATENCY_SPI_DONE);
+	__DMB();
+	p->state = PARKED_DONE;
+}
+
+// Records the parked traces whose frames have gone out, from the main loop
+void latencyCollect(void)
+{
+	for (unsigned int i = 0; i < N_PARKED_TRACES; i++) {
+		if (parked[i].state != PARKED_DONE) continue;
+		__DMB();
+		recordTrace(&parked[i].trace);
+		parked[i].state = PARKED_FREE;
+	}
+}
+
+const LatencyStage* getLatencyStage(unsigned int stage)
+{
+	return stage < N_LATENCY_STAGES ? &stages[stage] : NULL;
+}
+
+static uint8_t* put(uint8_t* out, uint64_t value, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++) {
+		*out++ = value & 0xFF;
+		value >>= 8;
+	}
+	return out;
+}
+
+// Writes all the stats in the format described in latency.h, returns the size or 0
+// if the buffer is too small
+size_t latencyDump(uint8_t* buffer, size_t size)
+{
+	if (size < LATENCY_DUMP_SIZE) return 0;
+	uint8_t* out = buffer;
+	out = put(out, LATENCY_DUMP_MAGIC, 4);
+	out = put(out, LATENCY_DUMP_VERSION, 2);
+	out = put(out, N_LATENCY_STAGES, 1);
+	out = put(out, N_LATENCY_BUCKETS, 1);
+	out = put(out, CMU_ClockFreqGet(cmuClock_CORE), 4);
+	for (unsigned int i = 0; i < N_LATENCY_STAGES; i++) {
+		const LatencyStage* stage = &stages[i];
+		out = put(out, stage->count, 4);
+		out = put(out, stage->count ? stage->min : 0, 4);
+		out = put(out, stage->max, 4);
+		out = put(out, stage->sum, 8);
+		for (unsigned int b = 0; b < N_LATENCY_BUCKETS; b++)
+			out = put(out, stage->buckets[b], 4);
+	}
+	return out - buffer;
+}
+
+#endif
@@ -0,0 +1,58 @@
+#include "transport.h"
+#if FPGA_TRANSPORT == TRANSPORT_LOOPBACK // only builds where there is a file system
+#include <stdio.h>
+#include <stdlib.h>
+
+static FILE* file = NULL;
+static ProtocolMirror mirror;
+static LoopbackStats loopback_stats = {0};
+
+void loopback_init(void)
+{
+	const char* path = getenv("LOOPBACK_FILE");
+	file = fopen(path != NULL ? path : LOOPBACK_FILE, "wb");
+	if (file == NULL) perror("loopback");
+}
+
+bool loopback_transmit(const uint8_t* data, uint16_t data_size)
+{
+	if (data_size == 0 || data_size > PROTOCOL_MAX_FRAME_SIZE) return false;
+	if (file != NULL) {
+		uint8_t length[2] = {data_size & 0xFF, data_size >> 8};
+		fwrite(length, 1, sizeof(length), file);
+		fwrite(data, 1, data_size, file);
+	}
+	loopback_stats.frames++;
+	loopback_stats.bytes += data_size;
+	if (!protocol_decode_frame(data, data_size, &mirror)) {
+		loopback_stats.frames_bad++;
+		return false;
+	}
+	return true;
+}
+
+bool loopback_transmit_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count)
+{
+	bool all = true;
+	for (uint32_t i = 0; i < count; i++) {
+		all &= loopback_transmit(data, sizes[i]);
+		data += sizes[i];
+	}
+	return all;
+}
+
+void loopback_flush(void)
+{
+	if (file != NULL) fflush(file);
+}
+
+LoopbackStats loopback_get_stats(void)
+{
+	return loopback_stats;
+}
+
+const ProtocolMirror* loopback_mirror(void)
+{
+	return &mirror;
+}
+#endif
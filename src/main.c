@@ -7,40 +7,58 @@
 #include "usbhost.h"
 #include "gpio.h"
 #include "fpga.h"
+#include "events.h"
+#include "latency.h"
 #include "em_chip.h"
 //#include "interrupts.h"
-#include "spi.h"
+#include "transport.h"
 #include <stdbool.h>
 
 void setupCMU(void);
 
+// Only there to wake the main loop now and then for the background refresh
+void SysTick_Handler(void)
+{
+}
+
 int main(void)
 {
 	CHIP_Init();
 	setupCMU();
 	setupGPIO();
 	setupTimer(1);
-	spi_init();
+	setupSampleClock();
+	latencyInit();
+	transport_init();
 	setExtLed(true);
 	pulse();
 	setExtLed(false);
 
 	while(!setDone());
+#if FPGA_TRANSPORT == TRANSPORT_SPI
+	spi_qualify_bitrate();
+#endif
 
-	MicrocontrollerGeneratorState** generator_states = malloc(sizeof(MicrocontrollerGeneratorState*) * N_GENERATORS);
-	for (uint8_t i = 0; i < N_GENERATORS; i++)
-		generator_states[i] = generator_state_new();
-	MicrocontrollerGlobalState* global_state = malloc(sizeof(global_state));
-	global_state = global_state_new();
+	generator_bank_init();
+	SysTick_Config(CMU_ClockFreqGet(cmuClock_CORE) / REFRESH_TICK_HZ);
 
 	MIDI_packet testing = {0x90, MIDI_C4, 0x7f};
-	handleMIDIEvent(&testing, generator_states);
+	handleMIDIEvent(&testing);
 
-	if(USBConnect()){
+	if(USBConnect() && USBStartReceiving()){
 		while(USBIsConnected()) {
             setExtLed(true);
-            MIDI_packet input = waitForInput();
-            handleMIDIEvent(&input, generator_states);
+            if (transport_take_resync())
+                microcontroller_resend_fpga_state();
+            if (processInput() == 0 && !microcontroller_refresh_fpga_state()) {
+                // Sleep until the next USB, button or SysTick interrupt. With interrupts masked an
+                // event can't sneak in between the check and the WFI, which still wakes up.
+                const unsigned char* data;
+                __disable_irq();
+                if (!hasEvent() && USBPeekPacket(&data, NULL) == 0 && !transport_resync_pending())
+                    __WFI();
+                __enable_irq();
+            }
         }
 	}
 }
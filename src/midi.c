@@ -17,3 +17,115 @@ bool validate_MIDI_packet(const byte* data, size_t length)
 			return false;
 	return true;
 }
+
+byte MIDI_data_length(byte status)
+{
+	// the number of data bytes following a status byte
+	switch (status & 0xF0) {
+		case 0xC0: case 0xD0: return 1; // program change, channel pressure
+		case 0xF0: switch (status) {
+			case 0xF1: case 0xF3: return 1; // time code quarter frame, song select
+			case 0xF2:            return 2; // song position pointer
+			default:              return 0;
+		}
+		default: return 2;
+	}
+}
+
+byte MIDI_USB_event_length(byte code_index)
+{
+	// the number of MIDI bytes in a USB-MIDI event packet, by its Code Index Number
+	switch (code_index & 0x0F) {
+		case 0x0: case 0x1:           return 0; // reserved
+		case 0x5: case 0xF:           return 1; // single byte
+		case 0x2: case 0x6:           return 2;
+		case 0xC: case 0xD:           return 2; // program change, channel pressure
+		default:                      return 3;
+	}
+}
+
+size_t MIDI_decode_USB_packet(const byte* data, size_t length, MIDI_packet* events, size_t max_events)
+{
+	// Turns every event packet in a USB transfer into a MIDI_packet, returns how many.
+	// SysEx (CIN 0x4, 0x6, 0x7 and the data bytes in 0x5) is skipped.
+	size_t count = 0;
+	for (size_t i = 0; i + USB_MIDI_EVENT_SIZE <= length && count < max_events; i += USB_MIDI_EVENT_SIZE) {
+		const byte* event = &data[i];
+		byte code_index = event[0] & 0x0F;
+		byte size = MIDI_USB_event_length(code_index);
+		if (size == 0) continue; // also the zero padding after the last event
+		if (code_index == 0x4 || code_index == 0x6 || code_index == 0x7) continue;
+		if (!(event[1] & 0x80) || event[1] == 0xF7) continue; // SysEx data, not a message
+
+		MIDI_packet* m = &events[count++];
+		m->data[0] = event[1];
+		m->data[1] = size > 1 ? event[2] : 0;
+		m->data[2] = size > 2 ? event[3] : 0;
+	}
+	return count;
+}
+
+void MIDI_parser_init(MIDI_parser* parser, MIDI_event_handler on_event, MIDI_sysex_handler on_sysex, void* context)
+{
+	parser->on_event = on_event;
+	parser->on_sysex = on_sysex;
+	parser->context  = context;
+	parser->message.data[0] = 0;
+	parser->expected = 0;
+	parser->received = 0;
+	parser->in_sysex = false;
+}
+
+static void MIDI_end_sysex(MIDI_parser* parser)
+{
+	parser->in_sysex = false;
+	if (parser->on_sysex) parser->on_sysex(NULL, 0, true, parser->context);
+}
+
+void MIDI_parse(MIDI_parser* parser, const byte* data, size_t length)
+{
+	size_t i = 0;
+	while (i < length) {
+		byte b = data[i];
+
+		if (parser->in_sysex && !(b & 0x80)) {
+			// hand the whole run of SysEx data bytes over without copying it
+			size_t start = i;
+			while (i < length && !(data[i] & 0x80)) i++;
+			if (parser->on_sysex) parser->on_sysex(&data[start], i - start, false, parser->context);
+			continue;
+		}
+		i++;
+
+		if (b >= 0xF8) { // realtime, may come in the middle of anything and changes nothing
+			MIDI_packet realtime = {{b, 0, 0}};
+			parser->on_event(&realtime, parser->context);
+			continue;
+		}
+
+		if (b & 0x80) { // status
+			if (parser->in_sysex) MIDI_end_sysex(parser); // any status ends SysEx, not only 0xF7
+			parser->received = 0;
+			if (b == 0xF0 || b == 0xF7) {
+				parser->in_sysex = b == 0xF0;
+				parser->message.data[0] = 0; // SysEx cancels running status, so does a stray 0xF7
+				continue;
+			}
+			parser->message.data[0] = b;
+			parser->expected = MIDI_data_length(b);
+			if (parser->expected > 0) continue;
+			parser->message.data[1] = 0;
+			parser->message.data[2] = 0;
+		} else { // data
+			if (parser->message.data[0] == 0) continue; // no status to go with it
+			parser->message.data[1 + parser->received++] = b;
+			if (parser->received < parser->expected) continue;
+			if (parser->expected == 1) parser->message.data[2] = 0;
+			parser->received = 0;
+		}
+
+		parser->on_event(&parser->message, parser->context);
+		if (parser->message.data[0] >= 0xF0)
+			parser->message.data[0] = 0; // system common messages have no running status
+	}
+}
@@ -0,0 +1,333 @@
+#include <string.h>
+#include "protocol.h"
+
+static byte* put_u16(byte* out, uint16_t value)
+{
+	out[0] = value & 0xFF;
+	out[1] = value >> 8;
+	return out + 2;
+}
+
+static byte* put_u32(byte* out, uint32_t value)
+{
+	out = put_u16(out, value & 0xFFFF);
+	return put_u16(out, value >> 16);
+}
+
+static uint16_t get_u16(const byte* in)
+{
+	return in[0] | (in[1] << 8);
+}
+
+static uint32_t get_u32(const byte* in)
+{
+	return get_u16(in) | ((uint32_t) get_u16(in + 2) << 16);
+}
+
+size_t protocol_encode_envelope(byte* out, const Envelope* envelope)
+{
+	byte* at = out;
+	at = put_u32(at, envelope->attack);
+	at = put_u32(at, envelope->decay);
+	at = put_u16(at, (uint16_t) envelope->sustain);
+	at = put_u32(at, envelope->release);
+	return at - out;
+}
+
+static void decode_envelope(const byte* in, Envelope* envelope)
+{
+	envelope->attack  = get_u32(in);
+	envelope->decay   = get_u32(in + 4);
+	envelope->sustain = (Sample) get_u16(in + 8);
+	envelope->release = get_u32(in + 10);
+}
+
+size_t protocol_encode_global(byte* out, const MicrocontrollerGlobalState* global)
+{
+	byte* at = out;
+	*at++ = PROTOCOL_HEADER(FRAME_GLOBAL_STATE);
+	*at++ = global->master_volume;
+	at += protocol_encode_envelope(at, &global->envelope);
+	for (uint i = 0; i < N_MIDI_CHANNELS; i++)
+		*at++ = (byte) global->pitchwheels[i];
+	return at - out;
+}
+
+size_t protocol_encode_generator_record(byte* out, ushort idx, bool reset_note_lifetime, const MicrocontrollerGeneratorState* state)
+{
+	byte* at = put_u16(out, idx);
+	*at++ = reset_note_lifetime;
+	*at++ = state->enabled;
+	*at++ = state->instrument;
+	*at++ = state->note_index;
+	*at++ = state->channel_index;
+	*at++ = state->velocity;
+	return at - out;
+}
+
+size_t protocol_encode_generator(byte* out, ushort idx, bool reset_note_lifetime, const MicrocontrollerGeneratorState* state)
+{
+	out[0] = PROTOCOL_HEADER(FRAME_GENERATOR);
+	return 1 + protocol_encode_generator_record(out + 1, idx, reset_note_lifetime, state);
+}
+
+size_t protocol_patch_size(byte opcode)
+{
+	switch (opcode) {
+		case PATCH_GENERATOR:     return PATCH_GENERATOR_SIZE;
+		case PATCH_ENABLED:       return PATCH_FIELD_SIZE;
+		case PATCH_VELOCITY:      return PATCH_FIELD_SIZE;
+		case PATCH_PITCHWHEEL:    return PATCH_PITCHWHEEL_SIZE;
+		case PATCH_MASTER_VOLUME: return PATCH_MASTER_VOLUME_SIZE;
+		case PATCH_ENVELOPE:      return PATCH_ENVELOPE_SIZE;
+		default:                  return 0;
+	}
+}
+
+static void decode_generator_record(const byte* in, ProtocolMirror* mirror, ProtocolApplied applied, void* context)
+{
+	ushort idx = get_u16(in);
+	MicrocontrollerGeneratorState* state = &mirror->generators[idx];
+	if (in[2]) {
+		mirror->note_resets++;
+		mirror->restarted[idx / 32] |= 1u << (idx % 32);
+	}
+	state->enabled       = in[3];
+	state->instrument    = in[4];
+	state->note_index    = in[5];
+	state->channel_index = in[6];
+	state->velocity      = in[7];
+	if (applied != NULL) applied(context, PATCH_GENERATOR, idx, in[2], mirror);
+}
+
+// Whether a patch record of a known size refers to something that exists
+static bool check_patch_record(const byte* in)
+{
+	const byte* args = in + 1;
+	switch (in[0]) {
+		case PATCH_GENERATOR:
+		case PATCH_ENABLED:
+		case PATCH_VELOCITY:
+			return get_u16(args) < N_GENERATORS;
+		case PATCH_PITCHWHEEL:
+			return args[0] < N_MIDI_CHANNELS;
+		default:
+			return true;
+	}
+}
+
+static void decode_patch_record(const byte* in, ProtocolMirror* mirror, ProtocolApplied applied, void* context)
+{
+	const byte* args = in + 1;
+	uint index = 0;
+	switch (in[0]) {
+		case PATCH_GENERATOR:
+			decode_generator_record(args, mirror, applied, context);
+			return;
+		case PATCH_ENABLED:
+			index = get_u16(args);
+			mirror->generators[index].enabled = args[2];
+			break;
+		case PATCH_VELOCITY:
+			index = get_u16(args);
+			mirror->generators[index].velocity = args[2];
+			break;
+		case PATCH_PITCHWHEEL:
+			index = args[0];
+			mirror->global.pitchwheels[index] = (sbyte) args[1];
+			break;
+		case PATCH_MASTER_VOLUME:
+			mirror->global.master_volume = args[0];
+			break;
+		case PATCH_ENVELOPE:
+			decode_envelope(args, &mirror->global.envelope);
+			break;
+	}
+	if (applied != NULL) applied(context, in[0], index, false, mirror);
+}
+
+bool protocol_apply_frame(const byte* data, size_t length, ProtocolMirror* mirror, ProtocolApplied applied, void* context)
+{
+	if (length < 1 || PROTOCOL_VERSION_OF(data[0]) != PROTOCOL_VERSION) return false;
+	switch (PROTOCOL_TYPE_OF(data[0])) {
+		case FRAME_GLOBAL_STATE:
+			if (length != PROTOCOL_GLOBAL_SIZE) return false;
+			mirror->global.master_volume = data[1];
+			decode_envelope(data + 2, &mirror->global.envelope);
+			for (uint i = 0; i < N_MIDI_CHANNELS; i++)
+				mirror->global.pitchwheels[i] = (sbyte) data[2 + PROTOCOL_ENVELOPE_SIZE + i];
+			if (applied != NULL) {
+				applied(context, PATCH_MASTER_VOLUME, 0, false, mirror);
+				applied(context, PATCH_ENVELOPE, 0, false, mirror);
+				for (uint i = 0; i < N_MIDI_CHANNELS; i++)
+					applied(context, PATCH_PITCHWHEEL, i, false, mirror);
+			}
+			return true;
+		case FRAME_GENERATOR:
+			if (length != PROTOCOL_GENERATOR_SIZE || get_u16(data + 1) >= N_GENERATORS) return false;
+			decode_generator_record(data + 1, mirror, applied, context);
+			return true;
+		case FRAME_PATCH: {
+			// checked whole before anything is applied, so a bad record halfway
+			// doesn't leave half a frame applied
+			if (length < PATCH_HEADER_SIZE) return false;
+			size_t at = PATCH_HEADER_SIZE;
+			for (uint i = 0; i < data[1]; i++) {
+				size_t size = at < length ? protocol_patch_size(data[at]) : 0;
+				if (size == 0 || at + size > length) return false;
+				if (!check_patch_record(data + at)) return false;
+				at += size;
+			}
+			if (at != length) return false;
+			at = PATCH_HEADER_SIZE;
+			for (uint i = 0; i < data[1]; i++) {
+				decode_patch_record(data + at, mirror, applied, context);
+				at += protocol_patch_size(data[at]);
+			}
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+bool protocol_decode_frame(const byte* data, size_t length, ProtocolMirror* mirror)
+{
+	return protocol_apply_frame(data, length, mirror, NULL, NULL);
+}
+
+uint16_t protocol_crc16(const byte* data, size_t length)
+{
+	uint16_t crc = 0xFFFF;
+	for (size_t i = 0; i < length; i++) {
+		crc ^= (uint16_t) data[i] << 8;
+		for (uint bit = 0; bit < 8; bit++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+// Consistent Overhead Byte Stuffing, gets rid of every 0 in the data so 0 can
+// mark where frames end. Costs one byte per 254.
+size_t protocol_cobs_encode(const byte* in, size_t length, byte* out)
+{
+	size_t code_at = 0, at = 1;
+	byte code = 1;
+	for (size_t i = 0; i < length; i++) {
+		if (in[i] != 0) {
+			out[at++] = in[i];
+			code++;
+		}
+		if (in[i] == 0 || code == 0xFF) {
+			out[code_at] = code;
+			code_at = at++;
+			code = 1;
+		}
+	}
+	out[code_at] = code;
+	return at;
+}
+
+// Returns the decoded length, 0 if it isn't valid COBS
+size_t protocol_cobs_decode(const byte* in, size_t length, byte* out)
+{
+	size_t at = 0;
+	for (size_t i = 0; i < length; ) {
+		byte code = in[i++];
+		if (code == 0 || i + code - 1 > length) return 0;
+		for (byte j = 1; j < code; j++) {
+			if (in[i] == 0) return 0;
+			out[at++] = in[i++];
+		}
+		if (code != 0xFF && i < length) out[at++] = 0;
+	}
+	return at;
+}
+
+size_t protocol_wrap(byte sequence, const byte* frame, size_t length, byte* out)
+{
+	// staged at the end of out, COBS never writes ahead of what it has read
+	byte* raw = out + PROTOCOL_WIRE_SIZE(length) - (length + PROTOCOL_LINK_OVERHEAD);
+	raw[0] = sequence;
+	memmove(raw + 1, frame, length);
+	uint16_t crc = protocol_crc16(raw, length + 1);
+	raw[length + 1] = crc & 0xFF;
+	raw[length + 2] = crc >> 8;
+	size_t size = protocol_cobs_encode(raw, length + PROTOCOL_LINK_OVERHEAD, out);
+	out[size++] = 0;
+	return size;
+}
+
+// Returns the frame length, 0 if the wire frame is broken
+size_t protocol_unwrap(const byte* wire, size_t length, byte* sequence, byte* frame)
+{
+	byte raw[PROTOCOL_WIRE_SIZE(PROTOCOL_MAX_FRAME_SIZE)];
+	if (length > sizeof(raw)) return 0;
+	size_t size = protocol_cobs_decode(wire, length, raw);
+	if (size < PROTOCOL_LINK_OVERHEAD + 1) return 0;
+	uint16_t crc = raw[size - 2] | (raw[size - 1] << 8);
+	if (protocol_crc16(raw, size - 2) != crc) return 0;
+	*sequence = raw[0];
+	memcpy(frame, raw + 1, size - PROTOCOL_LINK_OVERHEAD);
+	return size - PROTOCOL_LINK_OVERHEAD;
+}
+
+bool protocol_receive(ProtocolLink* link, const byte* wire, size_t length, ProtocolMirror* mirror)
+{
+	if (length == 0) return false; // the 0s between frames and of status polls
+	byte frame[PROTOCOL_WIRE_SIZE(PROTOCOL_MAX_FRAME_SIZE)];
+	byte sequence;
+	size_t size = protocol_unwrap(wire, length, &sequence, frame);
+	if (size == 0) {
+		link->errors++;
+		return false;
+	}
+	if (PROTOCOL_TYPE_OF(frame[0]) == FRAME_LINK_TEST && PROTOCOL_VERSION_OF(frame[0]) == PROTOCOL_VERSION) {
+		if (size > sizeof(link->echo)) {
+			link->errors++;
+			return false;
+		}
+		memcpy(link->echo, frame, size);
+		link->echo_size = size;
+		return false;
+	}
+	if (sequence != link->expected) {
+		// a repeat of one it already has is fine, a gap means one went missing
+		if ((byte) (link->expected - sequence) > 0x80) link->errors++;
+		return false;
+	}
+	if (!protocol_decode_frame(frame, size, mirror)) {
+		link->errors++;
+		return false;
+	}
+	link->expected++;
+	return true;
+}
+
+void protocol_link_select(ProtocolLink* link)
+{
+	link->reply[0] = PROTOCOL_STATUS_MAGIC;
+	link->reply[1] = link->expected;
+	link->reply[2] = link->errors;
+	link->reply[3] = PROTOCOL_STATUS_CHECK(link->expected, link->errors);
+	memcpy(link->reply + PROTOCOL_STATUS_SIZE, link->echo, link->echo_size);
+	link->reply_size = PROTOCOL_STATUS_SIZE + link->echo_size;
+	link->reply_pos = 0;
+	link->echo_size = 0;
+}
+
+byte protocol_link_byte(ProtocolLink* link, byte in, ProtocolMirror* mirror)
+{
+	byte out = link->reply_pos < link->reply_size ? link->reply[link->reply_pos++] : 0;
+	if (in == 0) {
+		if (link->wire_overflow) link->errors++;
+		else protocol_receive(link, link->wire, link->wire_size, mirror);
+		link->wire_size = 0;
+		link->wire_overflow = false;
+	} else if (link->wire_size < sizeof(link->wire)) {
+		link->wire[link->wire_size++] = in;
+	} else {
+		link->wire_overflow = true;
+	}
+	return out;
+}
@@ -1,4 +1,7 @@
 #include "spi.h"
+#include "latency.h"
+#include "em_core.h"
+#include <string.h>
 
 SPIDRV_HandleData_t handleData;
 SPIDRV_Handle_t handle = &handleData;
@@ -45,10 +48,245 @@ SPIDRV_Handle_t handle = &handleData;
 #endif
 #endif
 
+// Frames waiting to go out, copied in by spi_transmit and sent one after the other
+// from the transfer complete callback, so callers never wait for the bus. A frame
+// stays here after it went out until the FPGA's status says it got it, so that a
+// lost one can be sent again. See protocol.h for the link layer.
+typedef struct SpiFrame{
+	uint8_t data[SPI_FRAME_SIZE];
+	uint16_t size;
+	uint32_t started; // latencyNow() when it first went to the driver
+} SpiFrame;
+
+static SpiFrame frames[SPI_QUEUE_SIZE];
+static volatile uint32_t frame_head = 0; // only written by spi_transmit
+static volatile uint32_t frame_next = 0; // next one to send, goes back when the FPGA missed one
+static volatile uint32_t frame_tail = 0; // oldest one the FPGA hasn't confirmed
+static uint32_t frame_sent_end = 0;      // frames before this went out at least once
+static volatile bool transmitting = false;
+static volatile bool resync = false;
+static SpiStats spi_stats = {0};
+
+#define NO_FRAME 0xFFFFFFFF
+static uint32_t in_flight = NO_FRAME; // frame being sent, NO_FRAME for a status poll
+static uint8_t  sequence_base = 0;    // sequence number of frame 0
+static uint8_t  wire_tx[SPI_WIRE_SIZE];
+static uint8_t  wire_rx[SPI_WIRE_SIZE];
+static uint8_t  fpga_errors = 0;
+static bool     fpga_errors_known = false;
+static bool     fpga_seen = false; // a good status has come back at some point
+static int      rewound_to = -1; // sequence number last gone back to, until there is progress
+static uint     polls = 0;       // polls and resends since the FPGA last confirmed something
+static uint     retries = 0;
+
+#ifdef SPI_LOOPBACK
+// Stand-in for the FPGA, to run without one and to test on a PC. It is the
+// receiving end from protocol.c, and flips bits once the bitrate goes above
+// SPI_LOOPBACK. Transfers complete right away, the callbacks are run from a loop
+// rather than from each other so the stack doesn't grow with the queue.
+static ProtocolLink      loopback_link;
+static ProtocolMirror    loopback_mirror;
+static uint32_t          loopback_bitrate = SPI_BITRATE;
+static uint32_t          loopback_noise   = 1;
+static SPIDRV_Callback_t loopback_callback = NULL;
+static int               loopback_count;
+static bool              loopback_running = false;
+
+static uint8_t loopbackNoise(uint8_t value)
+{
+	if (loopback_bitrate <= SPI_LOOPBACK) return value;
+	loopback_noise = loopback_noise * 1664525 + 1013904223;
+	return (loopback_noise >> 27) == 0 ? value ^ (1 << ((loopback_noise >> 8) & 7)) : value;
+}
+
+static void loopbackTransfer(const uint8_t* tx, uint8_t* rx, int count)
+{
+	protocol_link_select(&loopback_link);
+	for (int i = 0; i < count; i++)
+		rx[i] = loopbackNoise(protocol_link_byte(&loopback_link, loopbackNoise(tx[i]), &loopback_mirror));
+}
+
+const ProtocolMirror* spi_loopback_mirror(void)
+{
+	return &loopback_mirror;
+}
+#endif
+
+// The only places that touch the driver
+static Ecode_t linkTransfer(const uint8_t* tx, uint8_t* rx, int count, SPIDRV_Callback_t callback)
+{
+#ifdef SPI_LOOPBACK
+	loopbackTransfer(tx, rx, count);
+	loopback_callback = callback;
+	loopback_count = count;
+	if (loopback_running) return ECODE_EMDRV_SPIDRV_OK;
+	loopback_running = true;
+	while (loopback_callback != NULL) {
+		SPIDRV_Callback_t next = loopback_callback;
+		loopback_callback = NULL;
+		next(handle, ECODE_EMDRV_SPIDRV_OK, loopback_count);
+	}
+	loopback_running = false;
+	return ECODE_EMDRV_SPIDRV_OK;
+#else
+	return SPIDRV_MTransfer(handle, tx, rx, count, callback);
+#endif
+}
+
+static Ecode_t linkTransferBlocking(const uint8_t* tx, uint8_t* rx, int count)
+{
+#ifdef SPI_LOOPBACK
+	loopbackTransfer(tx, rx, count);
+	return ECODE_EMDRV_SPIDRV_OK;
+#else
+	return SPIDRV_MTransferB(handle, tx, rx, count);
+#endif
+}
+
+static Ecode_t linkSetBitrate(uint32_t bitrate)
+{
+#ifdef SPI_LOOPBACK
+	loopback_bitrate = bitrate;
+	return ECODE_EMDRV_SPIDRV_OK;
+#else
+	return SPIDRV_SetBitrate(handle, bitrate);
+#endif
+}
+
+static inline uint8_t sequence_of(uint32_t frame)
+{
+	return (uint8_t) (frame + sequence_base);
+}
+
+static bool startTransfer(uint16_t size)
+{
+	transmitting = true;
+	if (linkTransfer(wire_tx, wire_rx, size, TransferComplete) == ECODE_EMDRV_SPIDRV_OK)
+		return true;
+	transmitting = false;
+	spi_stats.frames_failed++;
+	return false;
+}
+
+// With interrupts off, or from the callback
+static void startNextFrame(void)
+{
+	while (!transmitting && frame_next != frame_head) {
+		SpiFrame* frame = &frames[frame_next % SPI_QUEUE_SIZE];
+		in_flight = frame_next++;
+		if (in_flight < frame_sent_end) {
+			spi_stats.frames_resent++;
+		} else {
+			frame_sent_end = in_flight + 1;
+			frame->started = latencyNow();
+		}
+		uint16_t size = protocol_wrap(sequence_of(in_flight), frame->data, frame->size, wire_tx);
+		// if the driver wouldn't take it, the FPGA will report the gap and it's sent again
+		startTransfer(size);
+	}
+}
+
+// Nothing new to send, but there is something unconfirmed: clock out zeros, the
+// FPGA skips them, to hear how far it got.
+static void startPoll(void)
+{
+	in_flight = NO_FRAME;
+	memset(wire_tx, 0, PROTOCOL_STATUS_SIZE);
+	startTransfer(PROTOCOL_STATUS_SIZE);
+}
+
+// Go back to the first frame the FPGA doesn't have and send it and everything after
+// it again, that's all it's missing
+static void sendAgainFromTail(void)
+{
+	rewound_to = sequence_of(frame_tail);
+	frame_next = frame_tail;
+}
+
+// The FPGA has fallen behind what is still queued here, or reset. Drop everything,
+// continue the numbering where the FPGA is and have the main loop send all state.
+static void linkLost(uint8_t expected)
+{
+	spi_stats.link_lost++;
+	frame_tail = frame_next = frame_sent_end = frame_head;
+	sequence_base = expected - (uint8_t) frame_head;
+	rewound_to = -1;
+	polls = retries = 0;
+	resync = true;
+}
+
+static void handleStatus(void)
+{
+	uint8_t expected = wire_rx[1];
+	uint8_t errors = wire_rx[2];
+	if (wire_rx[0] != PROTOCOL_STATUS_MAGIC || wire_rx[3] != PROTOCOL_STATUS_CHECK(expected, errors)) {
+		// nobody speaking the link layer on the other end, nothing to resend from. Once
+		// there has been a good status this one just got garbled, wait for the next.
+		spi_stats.status_missing++;
+		if (!fpga_seen) frame_tail = frame_next;
+		return;
+	}
+	fpga_seen = true;
+
+	// everything before expected made it
+	uint8_t confirmed = expected - sequence_of(frame_tail);
+	if (confirmed > frame_next - frame_tail) {
+		linkLost(expected);
+		fpga_errors = errors;
+		return;
+	}
+	if (confirmed > 0) {
+		frame_tail += confirmed;
+		rewound_to = -1;
+		polls = retries = 0;
+	}
+
+	// it threw something away, once per gap is enough
+	bool new_errors = fpga_errors_known && errors != fpga_errors;
+	fpga_errors = errors;
+	fpga_errors_known = true;
+	if (new_errors && frame_tail != frame_next && rewound_to != expected)
+		sendAgainFromTail();
+}
+
 void TransferComplete( SPIDRV_Handle_t handle,
                        Ecode_t transferStatus,
                        int itemsTransferred )
-{}
+{
+	(void) handle;
+	(void) itemsTransferred;
+	transmitting = false;
+	if (transferStatus != ECODE_EMDRV_SPIDRV_OK) {
+		spi_stats.frames_failed++;
+	} else {
+		if (in_flight != NO_FRAME) {
+			SpiFrame* frame = &frames[in_flight % SPI_QUEUE_SIZE];
+			spi_stats.frames_sent++;
+			latencySpiDone(in_flight, frame->started, latencyNow());
+		}
+		handleStatus();
+	}
+
+	if (frame_next != frame_head) {
+		startNextFrame();
+	} else if (frame_tail != frame_next) {
+		// all out, but not all confirmed
+		if (polls < SPI_MAX_POLLS) {
+			polls++;
+			startPoll();
+		} else if (retries < SPI_MAX_RETRIES) {
+			retries++;
+			polls = 0;
+			sendAgainFromTail();
+			startNextFrame();
+		} else {
+			linkLost(sequence_of(frame_tail));
+		}
+	} else if (SPI_SPAM) {
+		// keep the bus going while there's nothing new, handy for the scope
+		startPoll();
+	}
+}
 
 void spi_init(void) {
 #ifdef SPI_GPIO
@@ -59,17 +297,118 @@ void spi_init(void) {
 #endif
 	// Initialize a SPI driver instance
 	SPIDRV_Init( handle, &initData );
+	spi_stats.bitrate = SPI_BITRATE;
+}
+
+static uint8_t testPattern(uint round, uint i)
+{
+	switch (round % 4) {
+		case 0:  return (i & 1) ? 0xAA : 0x55;          // every bit toggling
+		case 1:  return 1 << (i % 8);                   // walking one
+		case 2:  return ~(1 << (i % 8));                // walking zero
+		default: return (i * 167 + round * 13) ^ 0x5A;  // a bit of everything
+	}
+}
+
+// Sends a test pattern and reads back the FPGA's echo of it
+static bool linkTest(uint round)
+{
+	uint8_t frame[1 + PROTOCOL_LINK_TEST_SIZE];
+	frame[0] = PROTOCOL_HEADER(FRAME_LINK_TEST);
+	for (uint i = 0; i < PROTOCOL_LINK_TEST_SIZE; i++)
+		frame[1 + i] = testPattern(round, i);
+	spi_stats.link_tests++;
+
+	uint16_t size = protocol_wrap(0, frame, sizeof(frame), wire_tx);
+	if (linkTransferBlocking(wire_tx, wire_rx, size) != ECODE_EMDRV_SPIDRV_OK) return false;
+	// the echo comes after the status at the start of the next transfer
+	memset(wire_tx, 0, PROTOCOL_STATUS_SIZE + sizeof(frame));
+	if (linkTransferBlocking(wire_tx, wire_rx, PROTOCOL_STATUS_SIZE + sizeof(frame)) != ECODE_EMDRV_SPIDRV_OK)
+		return false;
+	return wire_rx[0] == PROTOCOL_STATUS_MAGIC && memcmp(wire_rx + PROTOCOL_STATUS_SIZE, frame, sizeof(frame)) == 0;
+}
+
+uint32_t spi_qualify_bitrate(void)
+{
+	static const uint32_t bitrates[] = SPI_BITRATES;
+	int fastest = -1;
+	for (uint i = 0; i < sizeof(bitrates) / sizeof(bitrates[0]); i++) {
+		if (linkSetBitrate(bitrates[i]) != ECODE_EMDRV_SPIDRV_OK) break;
+		uint errors = 0;
+		for (uint round = 0; round < SPI_QUALIFY_ROUNDS; round++)
+			errors += !linkTest(round);
+		spi_stats.link_test_errors += errors;
+		if (errors > 0) break;
+		fastest = i;
+	}
+	// nothing passed means nothing there that echoes, stay where we were told to be
+	uint32_t bitrate = SPI_BITRATE;
+	if (fastest >= 0)
+		bitrate = bitrates[fastest > SPI_QUALIFY_MARGIN ? fastest - SPI_QUALIFY_MARGIN : 0];
+	linkSetBitrate(bitrate);
+	spi_stats.bitrate = bitrate;
+	return bitrate;
+}
+
+// Makes the frames before head visible to the callback and gets them going
+static void publishFrames(uint32_t head)
+{
+	__DMB(); // the frames have to be there before the callback can see them
+	CORE_DECLARE_IRQ_STATE;
+	CORE_ENTER_ATOMIC();
+	frame_head = head;
+	startNextFrame();
+	CORE_EXIT_ATOMIC();
+}
+
+// Queues frames and returns right away, the data is copied so the buffer can be
+// reused. Only waits if the queue is full. Not to be called from interrupts.
+bool spi_transmit_burst(const uint8_t* data, const uint16_t* sizes, uint32_t count)
+{
+	for (uint32_t i = 0; i < count; i++)
+		if (sizes[i] > SPI_FRAME_SIZE || sizes[i] == 0) return false;
+
+	uint32_t head = frame_head;
+	for (uint32_t i = 0; i < count; i++) {
+		if (head - frame_tail >= SPI_QUEUE_SIZE) {
+			spi_stats.queue_full++;
+			publishFrames(head); // what's there has to go before there is room
+			while (head - frame_tail >= SPI_QUEUE_SIZE); // the FPGA confirming frames makes room
+		}
+		SpiFrame* frame = &frames[head % SPI_QUEUE_SIZE];
+		memcpy(frame->data, data, sizes[i]);
+		frame->size = sizes[i];
+		latencySpiQueued(head);
+		head++;
+		data += sizes[i];
+	}
+	publishFrames(head);
+	return true;
+}
+
+bool spi_transmit(const uint8_t* buffer, uint16_t buffer_size)
+{
+	return spi_transmit_burst(buffer, &buffer_size, 1);
+}
+
+bool spi_idle(void)
+{
+	return frame_tail == frame_head;
 }
 
+bool spi_resync_pending(void)
+{
+	return resync;
+}
+
+bool spi_take_resync(void)
+{
+	if (!resync) return false;
+	resync = false;
+	return true;
+}
 
-void spi_transmit(uint8_t* buffer, uint16_t buffer_size)
+SpiStats spi_get_stats(void)
 {
-  // Transmit data using a callback to catch transfer completion.
-  // to do nonblocking transmit instead, use SPIDRV_MTransmit and add the callback to the function call
-    if (SPI_SPAM) {
-        while(1) {
-            SPIDRV_MTransmitB( handle, buffer, buffer_size);
-        }
-    }
-	SPIDRV_MTransmitB( handle, buffer, buffer_size);
+	return spi_stats;
 }
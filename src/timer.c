@@ -1,5 +1,6 @@
 #include "timer.h"
 #include "defines.h"
+#include "em_core.h"
 
 TIMER_Init_TypeDef timerInit =
   {
@@ -16,6 +17,38 @@ TIMER_Init_TypeDef timerInit =
     .sync       = false,
   };
 
+TIMER_Init_TypeDef sampleClockInit =
+  {
+    .enable     = true,
+    .debugRun   = true,
+    .prescale   = timerPrescale1024,
+    .clkSel     = timerClkSelHFPerClk,
+    .fallAction = timerInputActionNone,
+    .riseAction = timerInputActionNone,
+    .mode       = timerModeUp,
+    .dmaClrAct  = false,
+    .quadModeX4 = false,
+    .oneShot    = false,
+    .sync       = false,
+  };
+
+static uint32_t sample_clock_freq = 1; // timer ticks per second
+// The ticks are converted as they come, so the samples carry on counting across the
+// ticks wrapping. What's left of a sample is kept in ticks times SAMPLE_RATE.
+static uint32_t sample_clock_ticks = 0; // as of the last sampleClockNow
+static uint32_t sample_clock_samples = 0;
+static uint32_t sample_clock_remainder = 0;
+
+#ifdef DEVICE_GECKO_STARTER_KIT
+static volatile uint32_t sample_clock_wraps = 0; // TIMER0 is only 16 bits wide, so we count its overflows
+
+void TIMER0_IRQHandler(void)
+{
+	TIMER_IntClear(TIMER0, TIMER_IF_OF);
+	sample_clock_wraps++;
+}
+#endif
+
 //delay in ms
 void setupTimer(uint16_t delay)
 {
@@ -51,6 +84,51 @@ void pulse(void)
 #endif
 }
 
+// Free running clock counting audio samples, used to estimate where the FPGA
+// is in each generator's envelope. It wraps after about a day. sampleClockNow has
+// to be called at least once per wrap of the timer, the main loop's refresh does.
+void setupSampleClock(void)
+{
+	sample_clock_freq = CMU_ClockFreqGet(cmuClock_HFPER) / 1024;
+	sample_clock_ticks = sample_clock_samples = sample_clock_remainder = 0;
+#ifdef DEVICE_SADIE
+	CMU_ClockEnable(cmuClock_WTIMER0, true);
+	TIMER_TopSet(WTIMER0, 0xFFFFFFFF);
+	TIMER_Init(WTIMER0, &sampleClockInit);
+#endif
+#ifdef DEVICE_GECKO_STARTER_KIT
+	CMU_ClockEnable(cmuClock_TIMER0, true);
+	TIMER_TopSet(TIMER0, 0xFFFF);
+	TIMER_IntEnable(TIMER0, TIMER_IF_OF);
+	NVIC_EnableIRQ(TIMER0_IRQn);
+	TIMER_Init(TIMER0, &sampleClockInit);
+#endif
+}
+
+uint32_t sampleClockNow(void)
+{
+	uint32_t ticks = 0;
+	CORE_DECLARE_IRQ_STATE;
+	CORE_ENTER_ATOMIC();
+#ifdef DEVICE_SADIE
+	ticks = TIMER_CounterGet(WTIMER0);
+#endif
+#ifdef DEVICE_GECKO_STARTER_KIT
+	uint32_t wraps = sample_clock_wraps;
+	uint32_t counter = TIMER_CounterGet(TIMER0);
+	// Overflowed since interrupts went off, the handler hasn't counted it yet
+	if ((TIMER_IntGet(TIMER0) & TIMER_IF_OF) && counter < 0x8000) wraps++;
+	ticks = (wraps << 16) | counter;
+#endif
+	uint64_t elapsed = (uint64_t)(ticks - sample_clock_ticks) * SAMPLE_RATE + sample_clock_remainder;
+	sample_clock_ticks = ticks;
+	sample_clock_samples += (uint32_t)(elapsed / sample_clock_freq);
+	sample_clock_remainder = (uint32_t)(elapsed % sample_clock_freq);
+	uint32_t samples = sample_clock_samples;
+	CORE_EXIT_ATOMIC();
+	return samples;
+}
+
 bool setDone(void) {
 	unsigned int flashed = GPIO_PinInGet(gpioPortC, 6);
 	if(flashed == 1) {
@@ -1,5 +1,7 @@
 #include "defines.h"
 #include "usbhost.h"
+#include "em_core.h"
+#include "latency.h"
 
 STATIC_UBUF(tmpBuf, 1024);
 static USBH_Device_TypeDef device;
@@ -7,7 +9,42 @@ static USBH_Ep_TypeDef ep[1];
 static USB_EndpointDescriptor_TypeDef *retval;
 static USB_EndpointDescriptor_TypeDef checker;
 
-static unsigned char readbuffer[4 * USB_OUTPUT_SIZE] = {0};
+// Single producer (the transfer complete callbacks) single consumer (main loop) ring
+// of received packets. Reads are issued straight into ring slots, in order, so nothing
+// is copied. With USB_RX_CHANNELS at 2 the IN endpoint is read through two host
+// channels in ping-pong, one transfer is always queued behind the one on the bus so
+// the device is never left NAKing while we re-arm. The queued one is on the bus
+// before a failure on the first can be seen, and there is no taking it back, so
+// every failed read loses the packet after it.
+typedef struct USB_rx_slot{
+	unsigned char data[USB_MAX_PACKET_SIZE];
+	int length; // 0 if the transfer failed, skipped by the reader
+	uint32_t time; // latencyNow() when it arrived
+	bool done;
+} USB_rx_slot;
+
+static USB_rx_slot rx_ring[USB_RX_RING_SIZE] __attribute__((aligned(4)));
+static volatile uint32_t rx_head = 0; // completed slots, only written by the callbacks
+static volatile uint32_t rx_tail = 0; // only written by the main loop
+static uint32_t rx_next = 0; // next slot to read into
+
+// Every channel needs its own copy of the endpoint for the stack to keep state in
+static USBH_Ep_TypeDef rx_ep[USB_RX_CHANNELS];
+static uint32_t rx_slot[USB_RX_CHANNELS];
+static bool rx_busy[USB_RX_CHANNELS];
+static uint8_t rx_retries[USB_RX_CHANNELS]; // of the read on the channel, see rxComplete
+static uint8_t rx_toggle = 0; // DATA0/DATA1 the next read should expect
+
+static int rxComplete0(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+#if USB_RX_CHANNELS > 1
+static int rxComplete1(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+#endif
+static const USB_XferCompleteCb_TypeDef rx_callbacks[USB_RX_CHANNELS] = {
+	rxComplete0,
+#if USB_RX_CHANNELS > 1
+	rxComplete1,
+#endif
+};
 
 bool USBConnect()
 {
@@ -20,7 +57,10 @@ bool USBConnect()
 	    	if (USBH_QueryDeviceB(tmpBuf, sizeof(tmpBuf), USBH_GetPortSpeed())
 	          == USB_STATUS_OK) {
 	    		USBH_InitDeviceData(&device, tmpBuf, ep, 1, USBH_GetPortSpeed());
-	    		int testy = USBH_AssignHostChannel(ep, 2);
+	    		for (int i = 0; i < USB_RX_CHANNELS; i++) {
+	    			rx_ep[i] = ep[0];
+	    			USBH_AssignHostChannel(&rx_ep[i], 2 + i);
+	    		}
 	    		retval = USBH_QGetEndpointDescriptor(tmpBuf, 0, 1, 0); 	// This can be removed?
 	    		checker = *retval;										// And this?
 	    	} else {
@@ -34,14 +74,120 @@ bool USBIsConnected(){
 	return USBH_DeviceConnected();
 }
 
-USB_output USBWaitForData(){
-	readbuffer[0] = 0;
-	while(readbuffer[0] == 0){ // Nullertull
-		USBH_ReadB(device.ep, readbuffer, USB_OUTPUT_SIZE, 0);
+static int readSize(int channel){
+	int size = rx_ep[channel].packetSize;
+	return size > USB_MAX_PACKET_SIZE ? USB_MAX_PACKET_SIZE : size;
+}
+
+// Both with interrupts off and from the callbacks. Queues reads on every idle channel
+// while there's room in the ring.
+static void armReads(void){
+	for (int i = 0; i < USB_RX_CHANNELS; i++) {
+		// Channels are armed in slot order so they go on the bus in that order too
+		int channel = rx_next % USB_RX_CHANNELS;
+		if (rx_busy[channel]) return;
+		if (rx_next - rx_tail >= USB_RX_RING_SIZE) return; // USBReleasePacket re-arms
+		USB_rx_slot* slot = &rx_ring[rx_next % USB_RX_RING_SIZE];
+		slot->done = false;
+		// Each transfer is one packet, the channels take turns on the data toggle
+		rx_ep[channel].toggle = rx_toggle;
+		if (USBH_Read(&rx_ep[channel], slot->data, readSize(channel), 0, rx_callbacks[channel]) != USB_STATUS_OK) return;
+		rx_toggle ^= 1;
+		rx_busy[channel] = true;
+		rx_retries[channel] = 0;
+		rx_slot[channel] = rx_next++;
+	}
+}
+
+// Runs in the USB interrupt
+static int rxComplete(int channel, USB_Status_TypeDef status, uint32_t xferred){
+	rx_busy[channel] = false;
+	USB_rx_slot* slot = &rx_ring[rx_slot[channel] % USB_RX_RING_SIZE];
+	bool queued = false; // the other channel's read, which is behind this one on the bus
+	for (int i = 0; i < USB_RX_CHANNELS; i++) queued |= rx_busy[i];
+
+	if (status == USB_STATUS_OK) {
+		// The stack moved the toggle on to what the device expects next, line the
+		// reads up with it again in case an error put them out of step
+		rx_toggle = rx_ep[channel].toggle ^ (queued ? 1 : 0);
+	} else if (status != USB_STATUS_DEVICE_REMOVED && !queued && rx_retries[channel] < USB_RX_RETRIES) {
+		// The device keeps the packet and its toggle until a read works, so read it
+		// again on the same channel into the same slot. The stack only touches the
+		// toggle when a transfer works, it's still the one this read had.
+		rx_retries[channel]++;
+		if (USBH_Read(&rx_ep[channel], slot->data, readSize(channel), 0, rx_callbacks[channel]) == USB_STATUS_OK) {
+			rx_busy[channel] = true;
+			return USB_STATUS_OK;
+		}
 	}
-	USB_output out;
-	for(int i = 0; i < USB_OUTPUT_SIZE; i++){
-		out.data[i] = readbuffer[i];
+	// Otherwise the read is given up and its slot left empty. If the other channel is
+	// queued it goes on the bus first and gets the packet, or loses it to the toggle
+	// mismatch, so a retry here would land behind it out of order. This channel is
+	// re-armed for the next slot instead, with the toggle after the queued read's.
+	// With nothing queued the device is still on this read's toggle.
+	if (status != USB_STATUS_OK && !queued) rx_toggle = rx_ep[channel].toggle;
+
+	slot->length = (status == USB_STATUS_OK) ? (int) xferred : 0;
+	slot->time = latencyNow();
+	slot->done = true;
+	if (status == USB_STATUS_DEVICE_REMOVED) return USB_STATUS_OK;
+
+	// Publish in order, a failed read still takes its turn as an empty slot
+	uint32_t head = rx_head;
+	while (head != rx_next && rx_ring[head % USB_RX_RING_SIZE].done) head++;
+	__DMB(); // the slots have to be filled in before the main loop can see them
+	rx_head = head;
+
+	armReads();
+	return USB_STATUS_OK;
+}
+
+static int rxComplete0(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining){
+	(void) remaining;
+	return rxComplete(0, status, xferred);
+}
+
+#if USB_RX_CHANNELS > 1
+static int rxComplete1(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining){
+	(void) remaining;
+	return rxComplete(1, status, xferred);
+}
+#endif
+
+bool USBStartReceiving(void){
+	CORE_DECLARE_IRQ_STATE;
+	CORE_ENTER_ATOMIC();
+	rx_head = rx_tail = rx_next = 0;
+	rx_toggle = ep[0].toggle;
+	armReads();
+	bool started = rx_busy[0];
+	CORE_EXIT_ATOMIC();
+	return started;
+}
+
+// Points data at the oldest received packet and returns its length, 0 if there is none.
+// The packet stays valid until USBReleasePacket. arrival can be NULL.
+int USBPeekPacket(const unsigned char** data, uint32_t* arrival){
+	while (rx_head != rx_tail) {
+		__DMB();
+		USB_rx_slot* slot = &rx_ring[rx_tail % USB_RX_RING_SIZE];
+		if (slot->length > 0) {
+			*data = slot->data;
+			if (arrival) *arrival = slot->time;
+			return slot->length;
+		}
+		USBReleasePacket(); // failed read
 	}
-	return out;
+	return 0;
+}
+
+void USBReleasePacket(void){
+	if (rx_head == rx_tail) return;
+	rx_tail++;
+	// The callbacks stop reading when the ring fills up, pick it back up now there's room
+	if (!USBH_DeviceConnected()) return;
+	CORE_DECLARE_IRQ_STATE;
+	CORE_ENTER_ATOMIC();
+	armReads();
+	CORE_EXIT_ATOMIC();
 }
@@ -0,0 +1,191 @@
+// Per event cost of finding generators for note-ons and note-offs, the allocator
+// in fpga.c against the linear scans it replaced. Built once per N_GENERATORS,
+// the cost of the new one should stay flat as that grows.
+// It is run twice. With the events far apart every release has finished by the
+// next note-on, which is the allocator on its own. With them 64 samples apart the
+// free generators are all still in their release, and the envelope aware pick in
+// pick_free_generator walks the free list looking for the quietest one.
+#include "host.h"
+
+#define EVENTS 200000
+#define ROUNDS 5
+
+typedef struct Event {
+	bool         on;
+	NoteIndex    note;
+	ChannelIndex channel;
+} Event;
+
+static Event events[EVENTS];
+
+// A keyboard player holding around one and a half times as many notes as there
+// are generators, so the bank stays full and note-ons keep stealing
+static void make_events(void)
+{
+	static bool held[8][N_MIDI_KEYS];
+	uint held_count = 0;
+	srand(1);
+	for (uint i = 0; i < EVENTS; i++) {
+		bool on = held_count < N_GENERATORS * 3 / 2 ? rand() % 2 : false;
+		if (held_count == 0) on = true;
+		Event e;
+		do {
+			e.channel = rand() % 8;
+			e.note    = 24 + rand() % 80;
+		} while (held[e.channel][e.note] != !on);
+		e.on = on;
+		held[e.channel][e.note] = on;
+		held_count += on ? 1 : -1;
+		events[i] = e;
+	}
+}
+
+// The allocator before, as it was in fpga.c: scans over an array of pointers to
+// heap allocated states, and activation counts to find the oldest one
+static MicrocontrollerGeneratorState* legacy_states[N_GENERATORS];
+static uint legacy_activation = 0;
+static uint legacy_activation_count[N_GENERATORS] = {0};
+
+static uint legacy_find_unused_generator_id(void)
+{
+	uint idx = 0;
+	while (idx < N_GENERATORS && legacy_states[idx]->enabled) idx++;
+	return idx;
+}
+
+static uint legacy_find_longest_active_generator_id(void)
+{
+	uint id = 0;
+	uint lowest_count = (uint)-1;
+	for (uint i = 0; i < N_GENERATORS; i++) {
+		if (legacy_activation_count[i] < lowest_count) {
+			lowest_count = legacy_activation_count[i];
+			id = i;
+		}
+	}
+	return id;
+}
+
+static uint legacy_find_specific_generator_id(NoteIndex note_index, uint channel_index)
+{
+	uint idx = 0;
+	while (idx < N_GENERATORS && !(
+		legacy_states[idx]->enabled
+		&& legacy_states[idx]->note_index    == note_index
+		&& legacy_states[idx]->channel_index == channel_index
+	)) idx++;
+	return idx;
+}
+
+static void legacy_event(const Event* e)
+{
+	if (e->on) {
+		uint idx = legacy_find_unused_generator_id();
+		if (idx == N_GENERATORS) idx = legacy_find_longest_active_generator_id();
+		legacy_activation++;
+		legacy_states[idx]->enabled       = true;
+		legacy_states[idx]->note_index    = e->note;
+		legacy_states[idx]->channel_index = e->channel;
+		legacy_activation_count[idx] = legacy_activation;
+	} else {
+		uint idx = legacy_find_specific_generator_id(e->note, e->channel);
+		if (idx == N_GENERATORS) return;
+		legacy_activation++;
+		legacy_states[idx]->enabled = false;
+	}
+}
+
+static void allocator_event(const Event* e)
+{
+	uint idx = find_specific_generator_id(e->note, e->channel);
+	if (e->on) {
+		if (is_valid_generator_id(idx)) {
+			retrigger_generator_id(idx, 100);
+			return;
+		}
+		idx = acquire_generator_id(e->note, e->channel, 100);
+		if (!is_valid_generator_id(idx)) steal_generator_id(e->note, e->channel, 100);
+	} else if (is_valid_generator_id(idx)) {
+		release_generator_id(idx);
+	}
+}
+
+static double run(void (*handle)(const Event*), Time spacing)
+{
+	// the best of a few rounds, in nanoseconds per event
+	uint64_t best = UINT64_MAX;
+	for (uint round = 0; round < ROUNDS; round++) {
+		uint64_t started = host_nanoseconds();
+		for (uint i = 0; i < EVENTS; i++) {
+			host_now += spacing;
+			handle(&events[i]);
+		}
+		uint64_t took = host_nanoseconds() - started;
+		if (took < best) best = took;
+	}
+	return (double) best / EVENTS;
+}
+
+// Finding the one free generator in an otherwise full bank, wherever it is: the
+// scan over the pointers before, the occupancy bitmask behind acquire_generator_id
+// after (with the release that frees it, and the list upkeep around both)
+#define SLOT_LOOKUPS 1000000
+
+static GeneratorIndex slots[SLOT_LOOKUPS];
+
+static double legacy_free_slot(void)
+{
+	uint64_t started = host_nanoseconds();
+	uint found = 0;
+	for (uint i = 0; i < SLOT_LOOKUPS; i++) {
+		legacy_states[slots[i]]->enabled = false;
+		uint idx = legacy_find_unused_generator_id();
+		legacy_states[idx]->enabled = true;
+		found += idx;
+	}
+	if (found == 0) printf("\n"); // so the loop isn't optimised away
+	return (double) (host_nanoseconds() - started) / SLOT_LOOKUPS;
+}
+
+static double allocator_free_slot(void)
+{
+	uint64_t started = host_nanoseconds();
+	for (uint i = 0; i < SLOT_LOOKUPS; i++) {
+		release_generator_id(slots[i]);
+		host_now += SAMPLE_RATE; // its release is over by now
+		acquire_generator_id(i & 0x7F, 15, 100);
+	}
+	return (double) (host_nanoseconds() - started) / SLOT_LOOKUPS;
+}
+
+static void bench_free_slot(void)
+{
+	for (uint i = 0; i < SLOT_LOOKUPS; i++)
+		slots[i] = rand() % N_GENERATORS;
+	// everything playing, the channel is out of the way of the notes acquired above
+	generator_bank_init();
+	for (uint i = 0; i < N_GENERATORS; i++) {
+		legacy_states[i]->enabled = true;
+		acquire_generator_id(i % N_MIDI_KEYS, 14 - i / N_MIDI_KEYS, 100);
+	}
+	double legacy = legacy_free_slot();
+	double allocator = allocator_free_slot();
+	printf("free slot N_GENERATORS=%-4d before %6.1f ns         after %6.1f ns\n",
+		N_GENERATORS, legacy, allocator);
+}
+
+int main(void)
+{
+	make_events();
+	for (uint i = 0; i < N_GENERATORS; i++)
+		legacy_states[i] = calloc(1, sizeof(MicrocontrollerGeneratorState));
+	generator_bank_init();
+
+	double legacy = run(legacy_event, SAMPLE_RATE);
+	double allocator = run(allocator_event, SAMPLE_RATE);
+	double releasing = run(allocator_event, 64);
+	printf("allocator N_GENERATORS=%-4d before %6.1f ns/event  after %6.1f ns/event  after, still releasing %6.1f ns/event\n",
+		N_GENERATORS, legacy, allocator, releasing);
+	bench_free_slot();
+	return 0;
+}
@@ -0,0 +1,62 @@
+// What a chord costs on the SPI link, each update as its own frame against all of
+// them batched into one, like processInput does for a USB packet. Frames and bytes
+// are counted as fpga.c sends them, the time on the wire is worked out from them:
+// the link layer bytes at the bitrate, plus a fixed cost per transfer for the
+// driver and chip select. That cost is an estimate, not measured on the board.
+#include "host.h"
+
+#define TRANSFER_OVERHEAD_US 15.0
+
+static const uint chords[] = {1, 3, 10};
+static const uint32_t bitrates[] = {100000, 1000000, 4000000, 8000000};
+
+typedef struct Cost{
+	uint frames;
+	uint wire_bytes;
+} Cost;
+
+// Every frame is well under 254 bytes, so COBS adds exactly one byte to each
+static Cost play(uint notes, bool on, bool batched)
+{
+	SpiUpdateStats before = *get_spi_update_stats();
+	if (batched) microcontroller_begin_batch();
+	for (uint i = 0; i < notes; i++)
+		host_midi(on ? 0x90 : 0x80, 48 + 3 * i, 100);
+	if (batched) microcontroller_end_batch();
+	const SpiUpdateStats* after = get_spi_update_stats();
+	Cost cost;
+	cost.frames = after->frames - before.frames;
+	cost.wire_bytes = after->bytes - before.bytes + cost.frames * PROTOCOL_WIRE_SIZE(0);
+	return cost;
+}
+
+static double microseconds(Cost cost, uint32_t bitrate)
+{
+	return cost.wire_bytes * 8e6 / bitrate + cost.frames * TRANSFER_OVERHEAD_US;
+}
+
+static void compare(uint notes, bool on)
+{
+	generator_bank_init();
+	if (!on) play(notes, true, false);
+	Cost single = play(notes, on, false);
+	generator_bank_init();
+	if (!on) play(notes, true, false);
+	Cost batched = play(notes, on, true);
+
+	printf("chord %2u %-3s frames %2u -> %u  wire bytes %3u -> %3u  us at", notes, on ? "on" : "off",
+		single.frames, batched.frames, single.wire_bytes, batched.wire_bytes);
+	for (uint i = 0; i < sizeof(bitrates) / sizeof(bitrates[0]); i++)
+		printf("  %u kbit/s %.0f -> %.0f", bitrates[i] / 1000,
+			microseconds(single, bitrates[i]), microseconds(batched, bitrates[i]));
+	printf("\n");
+}
+
+int main(void)
+{
+	for (uint i = 0; i < sizeof(chords) / sizeof(chords[0]); i++) {
+		compare(chords[i], true);
+		compare(chords[i], false);
+	}
+	return 0;
+}
@@ -0,0 +1,48 @@
+// Frames per second through the loopback transport, with it writing them to
+// LOOPBACK_FILE like a throughput test on a PC would. Every frame is decoded by
+// the loopback as well, so this is the encoding in fpga.c and protocol.c plus
+// the decoding and the file writes. Two loads: note-ons and note-offs one frame
+// each, and the whole state sent again, which goes out in bursts from one batch.
+#include "host.h"
+
+#define EVENTS  1000000
+#define RESENDS 20000
+
+static double seconds_since(uint64_t started)
+{
+	return (host_nanoseconds() - started) / 1e9;
+}
+
+static void report(const char* load, LoopbackStats before, double seconds)
+{
+	LoopbackStats after = loopback_get_stats();
+	CHECK(after.frames_bad == before.frames_bad);
+	uint32_t frames = after.frames - before.frames;
+	printf("loopback %-10s %8u frames  %6.2f Mframes/s  %6.1f MB/s\n", load, frames,
+		frames / seconds / 1e6, (after.bytes - before.bytes) / seconds / 1e6);
+}
+
+int main(void)
+{
+	setenv("LOOPBACK_FILE", "bench_loopback_frames.bin", 0);
+	loopback_init();
+	generator_bank_init();
+	srand(5);
+
+	LoopbackStats before = loopback_get_stats();
+	uint64_t started = host_nanoseconds();
+	for (uint i = 0; i < EVENTS; i++) {
+		host_now += 16;
+		host_midi((rand() % 2 ? 0x90 : 0x80) | (rand() % 4), 36 + rand() % 60, 1 + rand() % 127);
+	}
+	loopback_flush();
+	report("notes", before, seconds_since(started));
+
+	before = loopback_get_stats();
+	started = host_nanoseconds();
+	for (uint i = 0; i < RESENDS; i++)
+		microcontroller_resend_fpga_state();
+	loopback_flush();
+	report("resend", before, seconds_since(started));
+	return 0;
+}
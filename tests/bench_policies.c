@@ -0,0 +1,133 @@
+// Replays the same performance through each voice stealing policy: two hands on
+// one channel with the sustain pedal, and a pad held on another, more than the
+// generators can play at once. Built once per VOICE_STEAL_POLICY.
+// Notes cut off are counted by what was holding them: the key itself, or only the
+// pedal. Cutting off a held key is what is heard the most.
+#include "host.h"
+
+#define MAX_EVENTS 40000
+#define BARS       200
+#define BEAT       (SAMPLE_RATE / 2) // in samples, 120 bpm
+#define ROUNDS     5
+
+typedef struct Event {
+	Time at;
+	uint order; // ties keep the order they were made in
+	byte status, data1, data2;
+} Event;
+
+static Event events[MAX_EVENTS];
+static uint  event_count = 0;
+
+static void add(Time at, byte status, byte data1, byte data2)
+{
+	if (event_count == MAX_EVENTS) return;
+	events[event_count] = (Event) {at, event_count, status, data1, data2};
+	event_count++;
+}
+
+static void note(Time at, Time length, byte channel, byte key, byte velocity)
+{
+	add(at, 0x90 | channel, key, velocity);
+	add(at + length, 0x80 | channel, key, 0);
+}
+
+static int by_time(const void* a, const void* b)
+{
+	const Event* x = a;
+	const Event* y = b;
+	if (x->at != y->at) return x->at < y->at ? -1 : 1;
+	return x->order < y->order ? -1 : 1;
+}
+
+static void make_performance(void)
+{
+	srand(3);
+	for (uint bar = 0; bar < BARS; bar++) {
+		Time start = bar * 4 * BEAT;
+		byte root = 36 + rand() % 12;
+		// left hand, a chord on every beat
+		for (uint beat = 0; beat < 4; beat++)
+			for (uint i = 0; i < 4; i++)
+				note(start + beat * BEAT, BEAT - 10, 0, root + 12 + i * 4 + rand() % 2, 50 + rand() % 40);
+		// right hand, sixteenth notes
+		for (uint sixteenth = 0; sixteenth < 16; sixteenth++)
+			note(start + sixteenth * BEAT / 4, BEAT / 4 - 10, 0, 60 + rand() % 24, 60 + rand() % 60);
+		// the pedal is changed every half bar
+		for (uint half = 0; half < 2; half++) {
+			add(start + half * 2 * BEAT + 1, 0xB0, 64, 127);
+			add(start + (half + 1) * 2 * BEAT - 2, 0xB0, 64, 0);
+		}
+		// a pad on channel 1 held the whole bar
+		for (uint i = 0; i < 3; i++)
+			note(start, 4 * BEAT - 5, 1, root + 24 + i * 7, 40 + rand() % 20);
+	}
+	qsort(events, event_count, sizeof(Event), by_time);
+}
+
+static const char* policy_name(void)
+{
+	switch (VOICE_STEAL_POLICY) {
+		case STEAL_OLDEST:          return "oldest";
+		case STEAL_LOWEST_VELOCITY: return "lowest velocity";
+		case STEAL_RELEASED_FIRST:  return "released first";
+		case STEAL_SAME_NOTE:       return "same note";
+		case STEAL_ROUND_ROBIN:     return "round robin";
+		case STEAL_QUIETEST:        return "quietest";
+		default:                    return "?";
+	}
+}
+
+// Which notes have a generator, and of those whose key is still down
+static bool key_down[2][N_MIDI_KEYS];
+static uint cut_held = 0, cut_pedal = 0;
+
+static void replay_counting_cuts(Time offset)
+{
+	for (uint i = 0; i < event_count; i++) {
+		const Event* e = &events[i];
+		bool note_on = (e->status & 0xF0) == 0x90;
+		byte channel = e->status & 0x0F;
+		static bool had[2][N_MIDI_KEYS];
+		if (note_on)
+			for (uint c = 0; c < 2; c++)
+				for (uint k = 0; k < N_MIDI_KEYS; k++)
+					had[c][k] = is_valid_generator_id(find_specific_generator_id(k, c));
+		host_now = offset + e->at;
+		host_midi(e->status, e->data1, e->data2);
+		if ((e->status & 0xF0) == 0x80) key_down[channel][e->data1] = false;
+		if (!note_on) continue;
+		key_down[channel][e->data1] = true;
+		for (uint c = 0; c < 2; c++)
+			for (uint k = 0; k < N_MIDI_KEYS; k++)
+				if (had[c][k] && !is_valid_generator_id(find_specific_generator_id(k, c))) {
+					if (key_down[c][k]) cut_held++;
+					else                cut_pedal++;
+				}
+	}
+}
+
+int main(void)
+{
+	make_performance();
+	generator_bank_init();
+	replay_counting_cuts(0);
+	GeneratorStats stats = *get_generator_stats();
+
+	uint64_t best = UINT64_MAX;
+	for (uint round = 0; round < ROUNDS; round++) {
+		Time offset = host_now + SAMPLE_RATE;
+		uint64_t started = host_cycles();
+		for (uint i = 0; i < event_count; i++) {
+			host_now = offset + events[i].at;
+			host_midi(events[i].status, events[i].data1, events[i].data2);
+		}
+		uint64_t took = host_cycles() - started;
+		if (took < best) best = took;
+	}
+
+	printf("policy %-15s N_GENERATORS=%d  cut off: held keys %4u, pedal only %4u  queued %4u (started late %4u)  dropped %4u  %4.0f cycles/event\n",
+		policy_name(), N_GENERATORS, cut_held, cut_pedal, stats.notes_queued, stats.notes_late,
+		stats.notes_expired + stats.notes_dropped, (double) best / event_count);
+	return 0;
+}
@@ -0,0 +1,87 @@
+// The structure-of-arrays scans in fpga.c against the same scans over the packed
+// generator structs they replaced. They are static, so fpga.c is built in here
+// rather than linked. Off the M4 the lane operations fall back to plain C, see
+// lanes_sub_saturate, so this times the layout, not the SIMD instructions.
+#define ALL_LANE_SCANS // both, whatever the policy
+#include "../src/fpga.c"
+#include "host.h"
+
+#define SCANS  1000000
+#define ROUNDS 5
+
+static uint packed_lowest_velocity(void)
+{
+	uint victim = N_GENERATORS;
+	Velocity lowest = 0xFF;
+	for (uint idx = 0; idx < N_GENERATORS; idx++) {
+		const MicrocontrollerGeneratorState* state = &generator_bank.generators[idx];
+		if (state->enabled && state->velocity < lowest) {
+			lowest = state->velocity;
+			victim = idx;
+		}
+	}
+	return victim;
+}
+
+static uint packed_find(NoteIndex note_index, uint channel_index)
+{
+	for (uint idx = 0; idx < N_GENERATORS; idx++) {
+		const MicrocontrollerGeneratorState* state = &generator_bank.generators[idx];
+		if (state->enabled && state->note_index == note_index && state->channel_index == channel_index)
+			return idx;
+	}
+	return N_GENERATORS;
+}
+
+static NoteIndex    wanted_note[256];
+static ChannelIndex wanted_channel[256];
+
+static uint scan_lowest(uint i, bool packed)
+{
+	(void) i;
+	return packed ? packed_lowest_velocity() : find_lowest_velocity_generator();
+}
+
+static uint scan_find(uint i, bool packed)
+{
+	i &= 0xFF;
+	return packed ? packed_find(wanted_note[i], wanted_channel[i])
+	              : find_enabled_generator(wanted_note[i], wanted_channel[i]);
+}
+
+static double cycles_per_scan(uint (*scan)(uint, bool), bool packed)
+{
+	uint64_t best = UINT64_MAX;
+	uint sum = 0;
+	for (uint round = 0; round < ROUNDS; round++) {
+		uint64_t started = host_cycles();
+		for (uint i = 0; i < SCANS; i++)
+			sum += scan(i, packed);
+		uint64_t took = host_cycles() - started;
+		if (took < best) best = took;
+	}
+	if (sum == 1) printf("\n"); // so the scans aren't optimised away
+	return (double) best / SCANS;
+}
+
+int main(void)
+{
+	// every generator playing, at random velocities, on two channels
+	srand(5);
+	generator_bank_init();
+	for (uint i = 0; i < N_GENERATORS; i++)
+		host_midi(0x90 | (i % 2), i % N_MIDI_KEYS, 1 + rand() % 127);
+	// half the lookups hit a playing note somewhere in the bank, half miss
+	for (uint i = 0; i < 256; i++) {
+		uint idx = rand() % N_GENERATORS;
+		wanted_note[i]    = generator_note[idx];
+		wanted_channel[i] = i % 2 ? generator_channel[idx] : 5;
+		CHECK(packed_find(wanted_note[i], wanted_channel[i]) == find_enabled_generator(wanted_note[i], wanted_channel[i]));
+	}
+	CHECK(packed_lowest_velocity() == find_lowest_velocity_generator());
+
+	printf("scans N_GENERATORS=%-4d lowest velocity: before %6.1f after %6.1f  note lookup: before %6.1f after %6.1f cycles\n",
+		N_GENERATORS, cycles_per_scan(scan_lowest, true), cycles_per_scan(scan_lowest, false),
+		cycles_per_scan(scan_find, true), cycles_per_scan(scan_find, false));
+	return 0;
+}
@@ -0,0 +1,193 @@
+// The USB receive path in usbhost.c against a simulated bus and device, for how
+// long a packet the device has ready waits for a read to pick it up. Built once
+// with USB_RX_CHANNELS 1 and once with 2 (ping-pong).
+//
+// Time goes in bus ticks, one IN transaction each. The device gets bursts of 1 to
+// 40 packets at random. Reads go on the bus in the order they were issued, and a
+// finished one calls back LATENCY ticks later, standing in for the interrupt
+// latency, while the next queued read carries on. A failed transaction leaves the
+// packet and toggle on the device. A read with the wrong toggle gets the packet
+// ACKed and thrown away, like the host controller does, and the stack retries it
+// up to three times before reporting an error. The main loop drains the ring
+// every third tick and checks the packets come out in order.
+#include <string.h>
+#include "host.h"
+#include "usbhost.h"
+
+#define TICKS         2000000
+#define DRAIN_EVERY   3
+#define STACK_RETRIES 3 // of a toggle error, in em_usbhint.c
+
+typedef struct Read{
+	USBH_Ep_TypeDef* ep;
+	unsigned char* data;
+	USB_XferCompleteCb_TypeDef callback;
+	USB_Status_TypeDef status;
+	uint32_t length;
+	int toggle_errors;
+	long done_at;
+} Read;
+
+static Read bus[USB_RX_CHANNELS]; // issued reads, the first is the one on the bus
+static int bus_reads;
+static Read finished[USB_RX_CHANNELS]; // waiting out the interrupt latency
+static int finished_reads;
+
+static long now;
+static long latency;
+static double error_rate;
+
+static int device_toggle;
+static int device_ready; // packets queued on the device
+static long ready_since; // when the oldest of them got there
+static uint32_t sent, lost, errors;
+static long worst_wait, total_wait;
+static uint32_t received, last_received;
+
+int USBH_Init(const USBH_Init_TypeDef* p) { (void) p; return USB_STATUS_OK; }
+int USBH_WaitForDeviceConnectionB(uint8_t* buf, int timeoutInSeconds) { (void) buf; (void) timeoutInSeconds; return USB_STATUS_OK; }
+int USBH_QueryDeviceB(uint8_t* buf, size_t bufsize, uint8_t deviceSpeed) { (void) buf; (void) bufsize; (void) deviceSpeed; return USB_STATUS_OK; }
+uint8_t USBH_GetPortSpeed(void) { return 0; }
+int USBH_AssignHostChannel(USBH_Ep_TypeDef* ep, uint8_t hcnum) { (void) ep; (void) hcnum; return USB_STATUS_OK; }
+bool USBH_DeviceConnected(void) { return true; }
+
+int USBH_InitDeviceData(USBH_Device_TypeDef* device, const uint8_t* buf, USBH_Ep_TypeDef* ep, int numEp, uint8_t deviceSpeed)
+{
+	(void) buf;
+	(void) numEp;
+	(void) deviceSpeed;
+	device->ep = ep;
+	ep->packetSize = USB_MAX_PACKET_SIZE;
+	ep->toggle = 0;
+	return USB_STATUS_OK;
+}
+
+USB_EndpointDescriptor_TypeDef* USBH_QGetEndpointDescriptor(const uint8_t* buf, int configIndex, int interfaceIndex, int endpointIndex)
+{
+	static USB_EndpointDescriptor_TypeDef descriptor;
+	(void) buf;
+	(void) configIndex;
+	(void) interfaceIndex;
+	(void) endpointIndex;
+	return &descriptor;
+}
+
+int USBH_Read(USBH_Ep_TypeDef* ep, void* data, int byteCount, int timeout, USB_XferCompleteCb_TypeDef callback)
+{
+	(void) timeout;
+	CHECK(byteCount == USB_MAX_PACKET_SIZE);
+	CHECK(bus_reads < USB_RX_CHANNELS);
+	bus[bus_reads++] = (Read) {ep, data, callback, USB_STATUS_OK, 0, 0, 0};
+	return USB_STATUS_OK;
+}
+
+static void finish_read(USB_Status_TypeDef status, uint32_t length)
+{
+	Read read = bus[0];
+	memmove(&bus[0], &bus[1], --bus_reads * sizeof(Read));
+	read.status = status;
+	read.length = length;
+	read.done_at = now + latency;
+	finished[finished_reads++] = read;
+}
+
+static void packet_taken(void)
+{
+	long wait = now - ready_since;
+	if (wait > worst_wait) worst_wait = wait;
+	total_wait += wait;
+	sent++;
+	device_toggle ^= 1;
+	ready_since = --device_ready ? now + 1 : -1;
+}
+
+static void bus_tick(void)
+{
+	if (bus_reads == 0 || device_ready == 0) return; // nothing to read, or the device NAKs
+	Read* read = &bus[0];
+	if ((double) rand() / RAND_MAX < error_rate) {
+		errors++;
+		finish_read(USB_STATUS_EP_ERROR, 0);
+	} else if (read->ep->toggle != device_toggle) {
+		lost++;
+		packet_taken();
+		if (++read->toggle_errors == STACK_RETRIES) finish_read(USB_STATUS_EP_ERROR, 0);
+	} else {
+		memcpy(read->data, &sent, sizeof(sent)); // a sequence number for the order check
+		read->ep->toggle ^= 1;
+		packet_taken();
+		finish_read(USB_STATUS_OK, sizeof(sent));
+	}
+}
+
+static void drain(void)
+{
+	const unsigned char* data;
+	int length;
+	while ((length = USBPeekPacket(&data, NULL)) > 0) {
+		uint32_t sequence;
+		CHECK(length == sizeof(sequence));
+		memcpy(&sequence, data, sizeof(sequence));
+		CHECK(received == 0 || sequence > last_received); // lost ones leave gaps, nothing swaps
+		received++;
+		last_received = sequence;
+		USBReleasePacket();
+	}
+}
+
+static void run(long completion_latency, double failures)
+{
+	memset(bus, 0, sizeof(bus));
+	bus_reads = finished_reads = 0;
+	latency = completion_latency;
+	error_rate = failures;
+	device_toggle = device_ready = 0;
+	ready_since = -1;
+	sent = lost = errors = received = last_received = 0;
+	worst_wait = total_wait = 0;
+	srand(1);
+
+	USBConnect();
+	CHECK(USBStartReceiving());
+	for (now = 0; now < TICKS; now++) {
+		for (int i = 0; i < finished_reads; ) {
+			if (finished[i].done_at > now) {
+				i++;
+				continue;
+			}
+			Read read = finished[i];
+			memmove(&finished[i], &finished[i + 1], (--finished_reads - i) * sizeof(Read));
+			read.callback(read.status, read.length, 0);
+		}
+		if (device_ready == 0 && rand() % 200 == 0) {
+			device_ready = 1 + rand() % 40;
+			ready_since = now;
+		}
+		bus_tick();
+		if (now % DRAIN_EVERY == 0) drain();
+	}
+	drain();
+	// Unplugged, so the reads still out come back and the next run starts idle
+	for (int i = 0; i < finished_reads; i++) finished[i].callback(finished[i].status, finished[i].length, 0);
+	finished_reads = 0;
+	drain();
+	while (bus_reads) {
+		Read read = bus[0];
+		memmove(&bus[0], &bus[1], --bus_reads * sizeof(Read));
+		read.callback(USB_STATUS_DEVICE_REMOVED, 0, 0);
+	}
+	CHECK(received + lost == sent);
+	CHECK(failures > 0 || lost == 0);
+	CHECK(USB_RX_CHANNELS > 1 || lost == 0); // the default, failed reads are read again
+	printf("usb channels %d  latency %2ld ticks  errors %4.1f%%: worst wait %2ld  mean wait %5.2f ticks  lost %4u of %u packets (%u failed reads)\n",
+		USB_RX_CHANNELS, completion_latency, failures * 100, worst_wait, (double) total_wait / sent, lost, sent, errors);
+}
+
+int main(void)
+{
+	run(3, 0);
+	run(8, 0);
+	run(3, 0.01);
+	run(8, 0.01);
+	return 0;
+}
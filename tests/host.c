@@ -0,0 +1,87 @@
+#include <string.h>
+#include <time.h>
+#include "host.h"
+#include "input.h"
+#include "timer.h"
+
+Time host_now = 0;
+
+uint32_t sampleClockNow(void)
+{
+	return host_now;
+}
+
+int getInstrumentValue()
+{
+	return 0;
+}
+
+uint64_t host_nanoseconds(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+uint64_t host_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return host_nanoseconds();
+#endif
+}
+
+void host_midi(byte status, byte data1, byte data2)
+{
+	MIDI_packet m = {{status, data1, data2}};
+	handleMIDIEvent(&m);
+}
+
+#if FPGA_TRANSPORT == TRANSPORT_EBI
+MicrocontrollerGeneratorState host_fpga_generator(uint idx)
+{
+	const volatile uint16_t* regs = ebi_window() + EBI_REG_GENERATOR(idx);
+	MicrocontrollerGeneratorState state;
+	state.enabled       = regs[EBI_GENERATOR_CONTROL] & EBI_CONTROL_ENABLED;
+	state.instrument    = regs[EBI_GENERATOR_CONTROL] >> 8;
+	state.note_index    = regs[EBI_GENERATOR_NOTE] & 0xFF;
+	state.channel_index = regs[EBI_GENERATOR_NOTE] >> 8;
+	state.velocity      = regs[EBI_GENERATOR_VELOCITY];
+	return state;
+}
+
+static bool global_matches(const MicrocontrollerGlobalState* global)
+{
+	const volatile uint16_t* window = ebi_window();
+	const Envelope* envelope = &global->envelope;
+	const volatile uint16_t* regs = window + EBI_REG_ENVELOPE;
+	if (window[EBI_REG_MASTER_VOLUME] != global->master_volume) return false;
+	if ((regs[0] | (uint32_t) regs[1] << 16) != envelope->attack) return false;
+	if ((regs[2] | (uint32_t) regs[3] << 16) != envelope->decay) return false;
+	if ((int16_t) regs[4] != envelope->sustain) return false;
+	if ((regs[5] | (uint32_t) regs[6] << 16) != envelope->release) return false;
+	for (uint channel = 0; channel < N_MIDI_CHANNELS; channel++)
+		if ((int16_t) window[EBI_REG_PITCHWHEEL(channel)] != global->pitchwheels[channel]) return false;
+	return true;
+}
+#else
+MicrocontrollerGeneratorState host_fpga_generator(uint idx)
+{
+	return loopback_mirror()->generators[idx];
+}
+
+static bool global_matches(const MicrocontrollerGlobalState* global)
+{
+	return memcmp(&loopback_mirror()->global, global, sizeof(*global)) == 0;
+}
+#endif
+
+bool host_fpga_matches(void)
+{
+	for (uint idx = 0; idx < N_GENERATORS; idx++) {
+		MicrocontrollerGeneratorState fpga = host_fpga_generator(idx);
+		if (memcmp(&fpga, &get_generator_bank()->generators[idx], sizeof(fpga)) != 0) return false;
+	}
+	return global_matches(&get_generator_bank()->global);
+}
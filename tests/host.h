@@ -0,0 +1,36 @@
+#ifndef TESTS_HOST_H_
+#define TESTS_HOST_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fpga.h"
+#include "transport.h" // TRANSPORT_LOOPBACK or TRANSPORT_EBI with EBI_MEMORY
+
+// What the firmware gets from the hardware, faked for running on a PC
+
+extern Time host_now; // what sampleClockNow returns, tests move it along themselves
+
+// A monotonic clock for the benchmarks, in nanoseconds
+uint64_t host_nanoseconds(void);
+// The time stamp counter where there is one (x86), else host_nanoseconds
+uint64_t host_cycles(void);
+
+// Feeds one three byte MIDI message to handleMIDIEvent
+void host_midi(byte status, byte data1, byte data2);
+
+// What the FPGA has for a generator, from the loopback's mirror or read back out of
+// the EBI registers, whichever transport the firmware was built with
+MicrocontrollerGeneratorState host_fpga_generator(uint idx);
+// Whether everything the FPGA has matches generator_bank
+bool host_fpga_matches(void);
+
+#define CHECK(condition) do { \
+	if (!(condition)) { \
+		fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+		exit(1); \
+	} \
+} while (0)
+
+#endif /* TESTS_HOST_H_ */
@@ -0,0 +1,12 @@
+#ifndef TESTS_STUBS_EM_COMMON_H_
+#define TESTS_STUBS_EM_COMMON_H_
+
+// Stand-in for emlib's em_common.h on the host, only what the firmware uses
+#include <stdint.h>
+
+static inline uint32_t SL_CTZ(uint32_t value)
+{
+	return __builtin_ctz(value);
+}
+
+#endif /* TESTS_STUBS_EM_COMMON_H_ */
@@ -0,0 +1,12 @@
+#ifndef TESTS_STUBS_EM_CORE_H_
+#define TESTS_STUBS_EM_CORE_H_
+
+// Stand-in for emlib's em_core.h on the host. There are no interrupts, the
+// simulated USB callbacks run from the same thread as the main loop.
+#include "em_device.h"
+
+#define CORE_DECLARE_IRQ_STATE int irqState = 0
+#define CORE_ENTER_ATOMIC() (void) irqState
+#define CORE_EXIT_ATOMIC() (void) irqState
+
+#endif /* TESTS_STUBS_EM_CORE_H_ */
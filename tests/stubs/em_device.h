@@ -0,0 +1,9 @@
+#ifndef TESTS_STUBS_EM_DEVICE_H_
+#define TESTS_STUBS_EM_DEVICE_H_
+
+// Stand-in for the CMSIS device header on the host, only what usbhost.c uses
+#include <stdint.h>
+
+#define __DMB() __asm__ volatile("" ::: "memory")
+
+#endif /* TESTS_STUBS_EM_DEVICE_H_ */
@@ -0,0 +1,8 @@
+#ifndef TESTS_STUBS_EM_TIMER_H_
+#define TESTS_STUBS_EM_TIMER_H_
+
+// Stand-in for emlib's em_timer.h on the host, sampleClockNow comes from host.c
+#include <stdint.h>
+#include <stdbool.h>
+
+#endif /* TESTS_STUBS_EM_TIMER_H_ */
@@ -0,0 +1,48 @@
+#ifndef TESTS_STUBS_EM_USB_H_
+#define TESTS_STUBS_EM_USB_H_
+
+// Stand-in for emusb's em_usb.h on the host, only what usbhost.c uses. The
+// functions are up to whatever links it, bench_usb.c simulates the bus behind them.
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef enum {
+	USB_STATUS_OK = 0,
+	USB_STATUS_EP_ERROR = -5,
+	USB_STATUS_DEVICE_REMOVED = -9,
+} USB_Status_TypeDef;
+
+typedef int (*USB_XferCompleteCb_TypeDef)(USB_Status_TypeDef status, uint32_t xferred, uint32_t remaining);
+
+typedef struct {
+	int packetSize;
+	uint8_t toggle;
+} USBH_Ep_TypeDef;
+
+typedef struct {
+	USBH_Ep_TypeDef* ep;
+} USBH_Device_TypeDef;
+
+typedef struct {
+	uint8_t bEndpointAddress;
+} USB_EndpointDescriptor_TypeDef;
+
+typedef struct {
+	int unused;
+} USBH_Init_TypeDef;
+
+#define USBH_INIT_DEFAULT {0}
+#define STATIC_UBUF(x, n) static uint8_t x[n] __attribute__((aligned(4)))
+
+int USBH_Init(const USBH_Init_TypeDef* p);
+int USBH_WaitForDeviceConnectionB(uint8_t* buf, int timeoutInSeconds);
+int USBH_QueryDeviceB(uint8_t* buf, size_t bufsize, uint8_t deviceSpeed);
+uint8_t USBH_GetPortSpeed(void);
+int USBH_InitDeviceData(USBH_Device_TypeDef* device, const uint8_t* buf, USBH_Ep_TypeDef* ep, int numEp, uint8_t deviceSpeed);
+int USBH_AssignHostChannel(USBH_Ep_TypeDef* ep, uint8_t hcnum);
+USB_EndpointDescriptor_TypeDef* USBH_QGetEndpointDescriptor(const uint8_t* buf, int configIndex, int interfaceIndex, int endpointIndex);
+bool USBH_DeviceConnected(void);
+int USBH_Read(USBH_Ep_TypeDef* ep, void* data, int byteCount, int timeout, USB_XferCompleteCb_TypeDef callback);
+
+#endif /* TESTS_STUBS_EM_USB_H_ */
@@ -0,0 +1,36 @@
+#ifndef TESTS_STUBS_SPIDRV_H_
+#define TESTS_STUBS_SPIDRV_H_
+
+// Stand-in for emdrv's spidrv.h on the host, for spi.c built with SPI_LOOPBACK.
+// That never calls the driver past SPIDRV_Init, which is up to whatever links it.
+#include <stdint.h>
+
+typedef uint32_t Ecode_t;
+#define ECODE_EMDRV_SPIDRV_OK 0
+
+typedef struct SPIDRV_HandleData {
+	int unused;
+} SPIDRV_HandleData_t;
+typedef SPIDRV_HandleData_t* SPIDRV_Handle_t;
+typedef void (*SPIDRV_Callback_t)(SPIDRV_Handle_t handle, Ecode_t transferStatus, int itemsTransferred);
+
+// The fields of the SPIDRV_MASTER_ initialisers in spi.c, as plain ints
+enum {
+	USART0, USART1,
+	_USART_ROUTELOC0_TXLOC_LOC0, _USART_ROUTELOC0_RXLOC_LOC0, _USART_ROUTELOC0_CLKLOC_LOC0, _USART_ROUTELOC0_CSLOC_LOC0,
+	_USART_ROUTELOC0_TXLOC_LOC1, _USART_ROUTELOC0_RXLOC_LOC1, _USART_ROUTELOC0_CLKLOC_LOC1, _USART_ROUTELOC0_CSLOC_LOC1,
+	spidrvMaster, spidrvBitOrderMsbFirst, spidrvClockMode0, spidrvCsControlAuto, spidrvSlaveStartImmediate,
+};
+
+typedef struct SPIDRV_Init {
+	int port;
+	int portLocationTx, portLocationRx, portLocationClk, portLocationCs;
+	uint32_t bitRate;
+	unsigned frameLength;
+	uint32_t dummyTxValue;
+	int type, bitOrder, clockMode, csControl, slaveStartMode;
+} SPIDRV_Init_t;
+
+Ecode_t SPIDRV_Init(SPIDRV_Handle_t handle, SPIDRV_Init_t* initData);
+
+#endif /* TESTS_STUBS_SPIDRV_H_ */
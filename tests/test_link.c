@@ -0,0 +1,231 @@
+// The link layer in protocol.c: COBS and the CRC on their own, then frames
+// through the receiving end, whole with protocol_receive and a byte at a time
+// with protocol_link_byte. A corrupted frame has to be counted and dropped, a
+// repeat of one the receiver has taken ignored, and a gap counted.
+#include <string.h>
+#include "host.h"
+#include "protocol.h"
+
+static void cobs_round_trip(const byte* data, size_t length)
+{
+	byte wire[300], back[300];
+	size_t size = protocol_cobs_encode(data, length, wire);
+	CHECK(size <= length + 1 + length / 254); // a byte per 254 at most
+	for (size_t i = 0; i < size; i++)
+		CHECK(wire[i] != 0);
+	CHECK(protocol_cobs_decode(wire, size, back) == length);
+	CHECK(memcmp(back, data, length) == 0);
+}
+
+static void test_cobs(void)
+{
+	byte data[255];
+
+	// nothing at all is one code byte
+	byte wire[2];
+	CHECK(protocol_cobs_encode(NULL, 0, wire) == 1 && wire[0] == 1);
+
+	// 254 and 255 non-zero bytes either side of where a block is full, then with 0s in
+	for (size_t length = 253; length <= 255; length++) {
+		for (size_t i = 0; i < length; i++) data[i] = 1 + i % 255;
+		cobs_round_trip(data, length);
+		data[0] = data[length / 2] = data[length - 1] = 0;
+		cobs_round_trip(data, length);
+	}
+	memset(data, 0, sizeof(data));
+	cobs_round_trip(data, 1);
+	cobs_round_trip(data, 255);
+
+	// a 0 inside, or a code running past the end, isn't COBS
+	byte bad_zero[] = {3, 1, 0};
+	byte bad_code[] = {5, 1, 2};
+	byte back[8];
+	CHECK(protocol_cobs_decode(bad_zero, sizeof(bad_zero), back) == 0);
+	CHECK(protocol_cobs_decode(bad_code, sizeof(bad_code), back) == 0);
+}
+
+static void test_crc(void)
+{
+	// the CRC-16/CCITT-FALSE check value
+	CHECK(protocol_crc16((const byte*) "123456789", 9) == 0x29B1);
+	CHECK(protocol_crc16(NULL, 0) == 0xFFFF);
+}
+
+static ProtocolLink link;
+static ProtocolMirror mirror;
+
+// A generator frame for generator idx, as it goes on the wire, without the 0 at the end
+static size_t wire_frame(byte* wire, byte sequence, uint idx, Velocity velocity)
+{
+	MicrocontrollerGeneratorState state = {true, 0, 60, 0, velocity};
+	byte frame[PROTOCOL_GENERATOR_SIZE];
+	size_t size = protocol_encode_generator(frame, idx, true, &state);
+	size = protocol_wrap(sequence, frame, size, wire);
+	CHECK(wire[size - 1] == 0);
+	return size - 1;
+}
+
+static void reset(void)
+{
+	memset(&link, 0, sizeof(link));
+	memset(&mirror, 0, sizeof(mirror));
+}
+
+static void test_receive(void)
+{
+	reset();
+	byte wire[PROTOCOL_WIRE_SIZE(PROTOCOL_MAX_FRAME_SIZE)];
+	size_t size;
+
+	size = wire_frame(wire, 0, 1, 10);
+	CHECK(protocol_receive(&link, wire, size, &mirror));
+	CHECK(link.expected == 1 && link.errors == 0);
+	CHECK(mirror.generators[1].velocity == 10);
+
+	// the same again is a repeat, ignored and not an error
+	CHECK(!protocol_receive(&link, wire, size, &mirror));
+	CHECK(link.expected == 1 && link.errors == 0);
+
+	// one from further on means one went missing
+	size = wire_frame(wire, 2, 1, 20);
+	CHECK(!protocol_receive(&link, wire, size, &mirror));
+	CHECK(link.expected == 1 && link.errors == 1);
+	CHECK(mirror.generators[1].velocity == 10);
+
+	// every byte corrupted in turn, kept non-zero as the 0 would end the frame
+	size = wire_frame(wire, 1, 1, 30);
+	for (size_t i = 0; i < size; i++) {
+		byte saved = wire[i];
+		wire[i] = saved == 0xFF ? 0x7F : saved ^ 0x80;
+		byte errors = link.errors;
+		CHECK(!protocol_receive(&link, wire, size, &mirror));
+		CHECK(link.errors == (byte) (errors + 1));
+		CHECK(link.expected == 1);
+		wire[i] = saved;
+	}
+	CHECK(mirror.generators[1].velocity == 10);
+	CHECK(protocol_receive(&link, wire, size, &mirror));
+	CHECK(link.expected == 2 && mirror.generators[1].velocity == 30);
+
+	// a good frame that doesn't decode counts too
+	byte bad[] = {PROTOCOL_HEADER(FRAME_GENERATOR), N_GENERATORS, 0, 0, 0, 0, 0, 0, 0};
+	size = protocol_wrap(2, bad, sizeof(bad), wire) - 1;
+	byte errors = link.errors;
+	CHECK(!protocol_receive(&link, wire, size, &mirror));
+	CHECK(link.errors == (byte) (errors + 1) && link.expected == 2);
+
+	// repeats and gaps across the sequence number wrapping around
+	link.expected = 2;
+	errors = link.errors;
+	static const byte repeats[] = {1, 0, 255, 130};
+	for (uint i = 0; i < sizeof(repeats); i++) {
+		size = wire_frame(wire, repeats[i], 1, 40);
+		CHECK(!protocol_receive(&link, wire, size, &mirror));
+	}
+	CHECK(link.errors == errors);
+	static const byte gaps[] = {3, 100, 129};
+	for (uint i = 0; i < sizeof(gaps); i++) {
+		size = wire_frame(wire, gaps[i], 1, 40);
+		CHECK(!protocol_receive(&link, wire, size, &mirror));
+	}
+	CHECK(link.errors == (byte) (errors + sizeof(gaps)));
+	CHECK(mirror.generators[1].velocity == 30);
+}
+
+// One transfer: the bytes in go to protocol_link_byte, what it shifts out comes back in out
+static void transfer(const byte* in, size_t length, byte* out)
+{
+	protocol_link_select(&link);
+	for (size_t i = 0; i < length; i++) {
+		byte got = protocol_link_byte(&link, in[i], &mirror);
+		if (out != NULL) out[i] = got;
+	}
+}
+
+static void check_status(const byte* status, byte expected, byte errors)
+{
+	CHECK(status[0] == PROTOCOL_STATUS_MAGIC);
+	CHECK(status[1] == expected);
+	CHECK(status[2] == errors);
+	CHECK(status[3] == PROTOCOL_STATUS_CHECK(expected, errors));
+}
+
+static void test_link_bytes(void)
+{
+	reset();
+	byte wire[4 * PROTOCOL_WIRE_SIZE(PROTOCOL_MAX_FRAME_SIZE)];
+	byte status[sizeof(wire)];
+	size_t size = 0;
+
+	// two frames in one transfer
+	size += wire_frame(wire + size, 0, 2, 50) + 1;
+	size += wire_frame(wire + size, 1, 3, 60) + 1;
+	transfer(wire, size, status);
+	check_status(status, 0, 0);
+	CHECK(link.expected == 2 && link.errors == 0);
+	CHECK(mirror.generators[2].velocity == 50 && mirror.generators[3].velocity == 60);
+
+	// then the first again, and one past a gap
+	size = wire_frame(wire, 0, 2, 70) + 1;
+	size += wire_frame(wire + size, 5, 2, 70) + 1;
+	transfer(wire, size, status);
+	check_status(status, 2, 0);
+	CHECK(link.expected == 2 && link.errors == 1);
+	CHECK(mirror.generators[2].velocity == 50);
+
+	// a corrupted byte costs only the frame it was in
+	size = wire_frame(wire, 2, 2, 80) + 1;
+	wire[3] ^= 0x01;
+	if (wire[3] == 0) wire[3] = 0x02;
+	size += wire_frame(wire + size, 2, 4, 90) + 1;
+	transfer(wire, size, status);
+	check_status(status, 2, 1);
+	CHECK(link.errors == 2 && link.expected == 3);
+	CHECK(mirror.generators[2].velocity == 50 && mirror.generators[4].velocity == 90);
+
+	// as does more than fits in the receive buffer before a 0
+	memset(wire, 0x55, sizeof(link.wire) + 1);
+	wire[sizeof(link.wire) + 1] = 0;
+	transfer(wire, sizeof(link.wire) + 2, status);
+	check_status(status, 3, 2);
+	CHECK(link.errors == 3 && link.expected == 3);
+
+	// the status of the next poll shows it
+	memset(wire, 0, PROTOCOL_STATUS_SIZE);
+	transfer(wire, PROTOCOL_STATUS_SIZE, status);
+	check_status(status, 3, 3);
+}
+
+static void test_link_test_echo(void)
+{
+	reset();
+	byte frame[1 + PROTOCOL_LINK_TEST_SIZE];
+	frame[0] = PROTOCOL_HEADER(FRAME_LINK_TEST);
+	for (uint i = 1; i < sizeof(frame); i++) frame[i] = i * 37;
+	byte wire[PROTOCOL_WIRE_SIZE(sizeof(frame))];
+	// taken whatever its sequence number, and not counted as a frame
+	size_t size = protocol_wrap(200, frame, sizeof(frame), wire);
+	transfer(wire, size, NULL);
+	CHECK(link.expected == 0 && link.errors == 0);
+
+	byte poll[PROTOCOL_STATUS_SIZE + sizeof(frame)] = {0};
+	byte reply[sizeof(poll)];
+	transfer(poll, sizeof(poll), reply);
+	check_status(reply, 0, 0);
+	CHECK(memcmp(reply + PROTOCOL_STATUS_SIZE, frame, sizeof(frame)) == 0);
+
+	// and only once
+	transfer(poll, sizeof(poll), reply);
+	for (uint i = PROTOCOL_STATUS_SIZE; i < sizeof(reply); i++)
+		CHECK(reply[i] == 0);
+}
+
+int main(void)
+{
+	test_cobs();
+	test_crc();
+	test_receive();
+	test_link_bytes();
+	test_link_test_echo();
+	return 0;
+}
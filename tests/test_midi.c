@@ -0,0 +1,176 @@
+// MIDI_parse on byte streams with everything it has to handle: running status,
+// one, two and three byte messages, realtime bytes in the middle of a message,
+// SysEx and what ends it. Each stream is also fed a byte at a time, which has to
+// give the same events as feeding it whole.
+#include <string.h>
+#include "host.h"
+
+#define MAX_EVENTS 32
+
+typedef struct Parsed{
+	MIDI_packet events[MAX_EVENTS];
+	uint        event_count;
+	byte        sysex[64];
+	uint        sysex_size;
+	uint        sysex_ends;
+} Parsed;
+
+static void on_event(MIDI_packet* m, void* context)
+{
+	Parsed* parsed = context;
+	CHECK(parsed->event_count < MAX_EVENTS);
+	parsed->events[parsed->event_count++] = *m;
+}
+
+static void on_sysex(const byte* data, size_t length, bool complete, void* context)
+{
+	Parsed* parsed = context;
+	if (complete) {
+		CHECK(length == 0);
+		parsed->sysex_ends++;
+		return;
+	}
+	CHECK(length > 0 && parsed->sysex_size + length <= sizeof(parsed->sysex));
+	memcpy(&parsed->sysex[parsed->sysex_size], data, length);
+	parsed->sysex_size += length;
+}
+
+static Parsed parse(const byte* data, size_t length, bool byte_by_byte)
+{
+	Parsed parsed;
+	memset(&parsed, 0, sizeof(parsed));
+	MIDI_parser parser;
+	MIDI_parser_init(&parser, on_event, on_sysex, &parsed);
+	if (!byte_by_byte) {
+		MIDI_parse(&parser, data, length);
+	} else {
+		for (size_t i = 0; i < length; i++)
+			MIDI_parse(&parser, &data[i], 1);
+	}
+	return parsed;
+}
+
+// Parses data whole and a byte at a time, checks both give the events expected
+// (three bytes each) and returns the whole one for the SysEx checks
+static Parsed expect(const byte* data, size_t length, const byte (*events)[3], uint event_count)
+{
+	Parsed whole = parse(data, length, false);
+	Parsed split = parse(data, length, true);
+	CHECK(whole.event_count == event_count);
+	for (uint i = 0; i < event_count; i++)
+		CHECK(memcmp(whole.events[i].data, events[i], 3) == 0);
+	CHECK(memcmp(whole.events, split.events, sizeof(whole.events)) == 0);
+	CHECK(whole.event_count == split.event_count);
+	CHECK(whole.sysex_size == split.sysex_size && memcmp(whole.sysex, split.sysex, whole.sysex_size) == 0);
+	CHECK(whole.sysex_ends == split.sysex_ends);
+	return whole;
+}
+
+#define EXPECT(data, events) expect(data, sizeof(data), events, sizeof(events) / sizeof(events[0]))
+
+static void test_message_lengths(void)
+{
+	static const byte data[] = {
+		0x90, 60, 100,  // note-on, two data bytes
+		0xC3, 5,        // program change, one
+		0xF2, 0x10, 0x20, // song position, two
+		0xF1, 0x33,     // time code quarter frame, one
+		0xF6,           // tune request, none
+		0xB1, 64, 127,  // sustain pedal
+	};
+	static const byte events[][3] = {
+		{0x90, 60, 100}, {0xC3, 5, 0}, {0xF2, 0x10, 0x20}, {0xF1, 0x33, 0}, {0xF6, 0, 0}, {0xB1, 64, 127},
+	};
+	EXPECT(data, events);
+}
+
+static void test_running_status(void)
+{
+	static const byte data[] = {
+		0x90, 60, 100, 62, 100, 64, 0, // three note-ons under one status
+		0xD2, 10, 20, 30,              // channel pressure, one data byte each
+		0xF6, 1, 2,                    // system common cancels running status, the data is dropped
+		0x80, 60, 0, 62,               // and a message cut off by the next status is dropped
+		0x91, 70, 1,
+	};
+	static const byte events[][3] = {
+		{0x90, 60, 100}, {0x90, 62, 100}, {0x90, 64, 0},
+		{0xD2, 10, 0}, {0xD2, 20, 0}, {0xD2, 30, 0},
+		{0xF6, 0, 0},
+		{0x80, 60, 0},
+		{0x91, 70, 1},
+	};
+	EXPECT(data, events);
+}
+
+static void test_realtime(void)
+{
+	static const byte data[] = {
+		0xF8,                          // on its own
+		0x90, 0xF8, 60, 0xFA, 100,     // between the status and the data, and between the data bytes
+		62, 0xFE, 100,                 // in the middle of a running status message
+		0xF0, 1, 0xF8, 2, 0xF7,        // and of SysEx, which goes on after it
+		0xFF,
+	};
+	static const byte events[][3] = {
+		{0xF8, 0, 0}, {0xF8, 0, 0}, {0xFA, 0, 0}, {0x90, 60, 100},
+		{0xFE, 0, 0}, {0x90, 62, 100},
+		{0xF8, 0, 0},
+		{0xFF, 0, 0},
+	};
+	Parsed parsed = EXPECT(data, events);
+	CHECK(parsed.sysex_size == 2 && parsed.sysex[0] == 1 && parsed.sysex[1] == 2);
+	CHECK(parsed.sysex_ends == 1);
+}
+
+static void test_sysex(void)
+{
+	static const byte data[] = {
+		0x90, 60, 100,
+		0xF0, 0x7E, 0x7F, 0x06, 0x01, 0xF7, // identity request
+		62, 100,                            // SysEx cancelled running status, dropped
+		0x90, 64, 100,
+		0xF0, 0x43, 0x10, 0x80, 65, 0,      // ended by the next status byte, without 0xF7
+		0xF0, 0x01, 0xF7,
+	};
+	static const byte events[][3] = {
+		{0x90, 60, 100}, {0x90, 64, 100}, {0x80, 65, 0},
+	};
+	Parsed parsed = EXPECT(data, events);
+	static const byte sysex[] = {0x7E, 0x7F, 0x06, 0x01, 0x43, 0x10, 0x01};
+	CHECK(parsed.sysex_size == sizeof(sysex) && memcmp(parsed.sysex, sysex, sizeof(sysex)) == 0);
+	CHECK(parsed.sysex_ends == 3);
+}
+
+static void test_stray_end_of_sysex(void)
+{
+	// 0xF7 outside SysEx is system common too, and cancels running status
+	static const byte data[] = {
+		0x90, 60, 100,
+		0xF7, 62, 100, // no note-on for these
+		0x80, 60, 0,
+	};
+	static const byte events[][3] = {
+		{0x90, 60, 100}, {0x80, 60, 0},
+	};
+	Parsed parsed = EXPECT(data, events);
+	CHECK(parsed.sysex_ends == 0);
+}
+
+static void test_data_without_status(void)
+{
+	static const byte data[] = {60, 100, 0x90, 60, 100};
+	static const byte events[][3] = {{0x90, 60, 100}};
+	EXPECT(data, events);
+}
+
+int main(void)
+{
+	test_message_lengths();
+	test_running_status();
+	test_realtime();
+	test_sysex();
+	test_stray_end_of_sysex();
+	test_data_without_status();
+	return 0;
+}
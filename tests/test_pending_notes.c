@@ -0,0 +1,104 @@
+// A note-on that has to wait for a generator, and whose key comes up while the
+// sustain pedal is down. It should sound, held by the pedal, if a generator frees
+// up before the pedal is lifted, and never start if one only frees up after.
+// Built with STEAL_RELEASED_FIRST, so held keys are never stolen and the note has
+// to wait.
+#include "host.h"
+
+#define PENDING_NOTE 70
+
+static bool fpga_playing(NoteIndex note, ChannelIndex channel)
+{
+	for (uint i = 0; i < N_GENERATORS; i++) {
+		MicrocontrollerGeneratorState fpga = host_fpga_generator(i);
+		if (fpga.enabled && fpga.note_index == note && fpga.channel_index == channel) return true;
+	}
+	return false;
+}
+
+static bool playing(NoteIndex note, ChannelIndex channel)
+{
+	bool mapped = is_valid_generator_id(find_specific_generator_id(note, channel));
+	CHECK(mapped == fpga_playing(note, channel));
+	CHECK(host_fpga_matches());
+	return mapped;
+}
+
+// Every generator held by a key on channel 1, then the note-on on channel 0 that
+// has to wait, the pedal down and its note-off
+static void queue_and_release_under_pedal(void)
+{
+	generator_bank_init();
+	for (uint i = 0; i < N_GENERATORS; i++)
+		host_midi(0x91, 40 + i, 100);
+	GeneratorStats before = *get_generator_stats();
+	host_midi(0x90, PENDING_NOTE, 100);
+	CHECK(get_generator_stats()->notes_queued == before.notes_queued + 1);
+	CHECK(!playing(PENDING_NOTE, 0));
+	host_midi(0xB0, 64, 127); // pedal down
+	host_midi(0x80, PENDING_NOTE, 0);
+}
+
+static void test_pedal_lifted_first(void)
+{
+	queue_and_release_under_pedal();
+	host_midi(0xB0, 64, 0); // pedal up, nothing wants the note anymore
+	uint late = get_generator_stats()->notes_late;
+	host_midi(0x81, 40, 0); // frees a generator
+	CHECK(!playing(PENDING_NOTE, 0));
+	CHECK(get_generator_stats()->notes_late == late);
+	host_midi(0x81, 41, 0);
+	CHECK(!playing(PENDING_NOTE, 0));
+}
+
+static void test_generator_freed_first(void)
+{
+	queue_and_release_under_pedal();
+	uint late = get_generator_stats()->notes_late;
+	host_midi(0x81, 40, 0); // frees a generator while the pedal is still down
+	CHECK(playing(PENDING_NOTE, 0));
+	CHECK(get_generator_stats()->notes_late == late + 1);
+	host_midi(0xB0, 64, 0); // pedal up, the pedal was all that held it
+	CHECK(!playing(PENDING_NOTE, 0));
+}
+
+// A queue full of notes that waited too long mustn't keep a new one out
+static void test_stale_queue(void)
+{
+	generator_bank_init();
+	for (uint i = 0; i < N_GENERATORS; i++)
+		host_midi(0x91, 40 + i, 100);
+	for (uint i = 0; i < PENDING_NOTE_QUEUE_SIZE; i++)
+		host_midi(0x90, 100 + i, 100);
+	GeneratorStats before = *get_generator_stats();
+	host_midi(0x90, 99, 100); // the queue is full
+	CHECK(get_generator_stats()->notes_dropped == before.notes_dropped + 1);
+	host_now += PENDING_NOTE_MAX_AGE + 1;
+	host_midi(0x90, PENDING_NOTE, 100);
+	CHECK(get_generator_stats()->notes_dropped == before.notes_dropped + 1);
+	CHECK(get_generator_stats()->notes_expired == before.notes_expired + PENDING_NOTE_QUEUE_SIZE);
+	CHECK(get_generator_stats()->notes_queued == before.notes_queued + 1);
+	host_midi(0x81, 40, 0); // frees a generator, which the fresh note gets
+	CHECK(playing(PENDING_NOTE, 0));
+}
+
+static void clear(void)
+{
+	// lets go of everything between tests
+	for (uint channel = 0; channel < 2; channel++) {
+		host_midi(0xB0 | channel, 64, 0);
+		host_midi(0xB0 | channel, 120, 0);
+	}
+}
+
+int main(void)
+{
+	test_pedal_lifted_first();
+	clear();
+	test_generator_freed_first();
+	clear();
+	test_stale_queue();
+	clear();
+	printf("pending notes ok\n");
+	return 0;
+}
@@ -0,0 +1,259 @@
+// Frames from the encoders in protocol.c decoded back by protocol_apply_frame:
+// the global state, a generator and a patch with every opcode have to come out
+// as they went in. Frames from another version, cut short or naming a generator
+// or channel that doesn't exist have to be rejected without touching the mirror.
+#include <string.h>
+#include "host.h"
+#include "protocol.h"
+
+static ProtocolMirror mirror;
+static byte applied_opcodes[64];
+static uint applied_indices[64];
+static uint applied_count;
+
+static void applied(void* context, byte opcode, uint index, bool restart, const ProtocolMirror* from)
+{
+	(void) context;
+	(void) restart;
+	CHECK(from == &mirror);
+	CHECK(applied_count < sizeof(applied_opcodes));
+	applied_opcodes[applied_count] = opcode;
+	applied_indices[applied_count++] = index;
+}
+
+static bool apply(const byte* frame, size_t length)
+{
+	applied_count = 0;
+	return protocol_apply_frame(frame, length, &mirror, applied, NULL);
+}
+
+// A rejected frame leaves the mirror as it was and reports nothing
+static void rejected(const byte* frame, size_t length)
+{
+	ProtocolMirror before = mirror;
+	CHECK(!apply(frame, length));
+	CHECK(applied_count == 0);
+	CHECK(memcmp(&before, &mirror, sizeof(mirror)) == 0);
+}
+
+static MicrocontrollerGlobalState some_global(void)
+{
+	MicrocontrollerGlobalState global;
+	global.master_volume = 99;
+	global.envelope = (Envelope) {0x12345678, 0x00ABCDEF, -1234, 0x80000001};
+	for (uint i = 0; i < N_MIDI_CHANNELS; i++)
+		global.pitchwheels[i] = (sbyte) (i * 17 - 64);
+	return global;
+}
+
+static MicrocontrollerGeneratorState some_generator(void)
+{
+	return (MicrocontrollerGeneratorState) {true, 3, 61, 5, 127};
+}
+
+static void test_global(void)
+{
+	memset(&mirror, 0, sizeof(mirror));
+	MicrocontrollerGlobalState global = some_global();
+	byte frame[PROTOCOL_MAX_FRAME_SIZE];
+	size_t size = protocol_encode_global(frame, &global);
+	CHECK(size == PROTOCOL_GLOBAL_SIZE);
+	CHECK(apply(frame, size));
+	CHECK(memcmp(&mirror.global, &global, sizeof(global)) == 0);
+	CHECK(applied_count == 2 + N_MIDI_CHANNELS);
+	CHECK(applied_opcodes[0] == PATCH_MASTER_VOLUME);
+	CHECK(applied_opcodes[1] == PATCH_ENVELOPE);
+	for (uint i = 0; i < N_MIDI_CHANNELS; i++)
+		CHECK(applied_opcodes[2 + i] == PATCH_PITCHWHEEL && applied_indices[2 + i] == i);
+}
+
+static void test_generator(void)
+{
+	memset(&mirror, 0, sizeof(mirror));
+	MicrocontrollerGeneratorState state = some_generator();
+	byte frame[PROTOCOL_MAX_FRAME_SIZE];
+	for (uint idx = 0; idx < N_GENERATORS; idx += N_GENERATORS - 1) { // the first and the last
+		size_t size = protocol_encode_generator(frame, idx, true, &state);
+		CHECK(size == PROTOCOL_GENERATOR_SIZE);
+		CHECK(apply(frame, size));
+		CHECK(memcmp(&mirror.generators[idx], &state, sizeof(state)) == 0);
+		CHECK(mirror.restarted[idx / 32] & (1u << (idx % 32)));
+		CHECK(applied_count == 1 && applied_opcodes[0] == PATCH_GENERATOR && applied_indices[0] == idx);
+	}
+	CHECK(mirror.note_resets == 2);
+
+	// without the reset flag the note carries on
+	state.velocity = 1;
+	size_t size = protocol_encode_generator(frame, 0, false, &state);
+	CHECK(apply(frame, size));
+	CHECK(mirror.generators[0].velocity == 1);
+	CHECK(mirror.note_resets == 2);
+}
+
+// One record of each opcode in one patch frame, the way fpga.c lays them out
+static size_t encode_every_patch(byte* frame, ushort idx, byte channel)
+{
+	MicrocontrollerGlobalState global = some_global();
+	MicrocontrollerGeneratorState state = some_generator();
+	byte* at = frame;
+	*at++ = PROTOCOL_HEADER(FRAME_PATCH);
+	*at++ = 6;
+	*at++ = PATCH_GENERATOR;
+	at += protocol_encode_generator_record(at, idx, false, &state);
+	*at++ = PATCH_ENABLED;
+	*at++ = idx & 0xFF;
+	*at++ = idx >> 8;
+	*at++ = false;
+	*at++ = PATCH_VELOCITY;
+	*at++ = idx & 0xFF;
+	*at++ = idx >> 8;
+	*at++ = 42;
+	*at++ = PATCH_PITCHWHEEL;
+	*at++ = channel;
+	*at++ = (byte) -100;
+	*at++ = PATCH_MASTER_VOLUME;
+	*at++ = 7;
+	*at++ = PATCH_ENVELOPE;
+	at += protocol_encode_envelope(at, &global.envelope);
+	return at - frame;
+}
+
+static void test_patch(void)
+{
+	memset(&mirror, 0, sizeof(mirror));
+	byte frame[PROTOCOL_MAX_FRAME_SIZE];
+	ushort idx = N_GENERATORS - 1;
+	byte channel = N_MIDI_CHANNELS - 1;
+	size_t size = encode_every_patch(frame, idx, channel);
+	CHECK(size == PATCH_HEADER_SIZE + PATCH_GENERATOR_SIZE + 2 * PATCH_FIELD_SIZE
+		+ PATCH_PITCHWHEEL_SIZE + PATCH_MASTER_VOLUME_SIZE + PATCH_ENVELOPE_SIZE);
+	CHECK(apply(frame, size));
+
+	MicrocontrollerGeneratorState state = some_generator();
+	state.enabled = false;
+	state.velocity = 42;
+	CHECK(memcmp(&mirror.generators[idx], &state, sizeof(state)) == 0);
+	CHECK(mirror.global.pitchwheels[channel] == -100);
+	CHECK(mirror.global.master_volume == 7);
+	MicrocontrollerGlobalState global = some_global();
+	CHECK(memcmp(&mirror.global.envelope, &global.envelope, sizeof(Envelope)) == 0);
+	CHECK(mirror.note_resets == 0);
+
+	static const byte opcodes[] = {PATCH_GENERATOR, PATCH_ENABLED, PATCH_VELOCITY,
+		PATCH_PITCHWHEEL, PATCH_MASTER_VOLUME, PATCH_ENVELOPE};
+	CHECK(applied_count == sizeof(opcodes));
+	for (uint i = 0; i < sizeof(opcodes); i++)
+		CHECK(applied_opcodes[i] == opcodes[i]);
+	CHECK(applied_indices[0] == idx && applied_indices[1] == idx && applied_indices[2] == idx);
+	CHECK(applied_indices[3] == channel);
+
+	// an empty patch is fine too
+	byte empty[] = {PROTOCOL_HEADER(FRAME_PATCH), 0};
+	CHECK(apply(empty, sizeof(empty)));
+	CHECK(applied_count == 0);
+}
+
+static void test_wrong_version(void)
+{
+	memset(&mirror, 0, sizeof(mirror));
+	MicrocontrollerGlobalState global = some_global();
+	MicrocontrollerGeneratorState state = some_generator();
+	byte frame[PROTOCOL_MAX_FRAME_SIZE];
+
+	size_t size = protocol_encode_global(frame, &global);
+	for (uint version = 0; version < 16; version++) {
+		if (version == PROTOCOL_VERSION) continue;
+		frame[0] = (version << 4) | FRAME_GLOBAL_STATE;
+		rejected(frame, size);
+	}
+	size = protocol_encode_generator(frame, 0, true, &state);
+	frame[0] = ((PROTOCOL_VERSION + 1) << 4) | FRAME_GENERATOR;
+	rejected(frame, size);
+	size = encode_every_patch(frame, 0, 0);
+	frame[0] = ((PROTOCOL_VERSION - 1) << 4) | FRAME_PATCH;
+	rejected(frame, size);
+
+	// and types that don't exist, or aren't for the mirror
+	size = protocol_encode_generator(frame, 0, true, &state);
+	frame[0] = PROTOCOL_HEADER(0);
+	rejected(frame, size);
+	frame[0] = PROTOCOL_HEADER(FRAME_LINK_TEST);
+	rejected(frame, size);
+	frame[0] = PROTOCOL_HEADER(15);
+	rejected(frame, size);
+}
+
+// Every frame cut short anywhere, and with a byte too many
+static void test_wrong_length(void)
+{
+	memset(&mirror, 0, sizeof(mirror));
+	MicrocontrollerGlobalState global = some_global();
+	MicrocontrollerGeneratorState state = some_generator();
+	byte frames[3][PROTOCOL_MAX_FRAME_SIZE + 1];
+	size_t sizes[3];
+	sizes[0] = protocol_encode_global(frames[0], &global);
+	sizes[1] = protocol_encode_generator(frames[1], 1, true, &state);
+	sizes[2] = encode_every_patch(frames[2], 1, 1);
+	for (uint i = 0; i < 3; i++) {
+		for (size_t length = 0; length < sizes[i]; length++)
+			rejected(frames[i], length);
+		frames[i][sizes[i]] = PATCH_MASTER_VOLUME;
+		rejected(frames[i], sizes[i] + 1);
+	}
+
+	// a patch claiming more records than it has, or fewer
+	frames[2][1] = 7;
+	rejected(frames[2], sizes[2]);
+	frames[2][1] = 5;
+	rejected(frames[2], sizes[2]);
+}
+
+static void test_out_of_range(void)
+{
+	memset(&mirror, 0, sizeof(mirror));
+	MicrocontrollerGeneratorState state = some_generator();
+	byte frame[PROTOCOL_MAX_FRAME_SIZE];
+
+	size_t size = protocol_encode_generator(frame, N_GENERATORS, true, &state);
+	rejected(frame, size);
+	size = protocol_encode_generator(frame, 0xFFFF, true, &state);
+	rejected(frame, size);
+
+	// each indexed record out of range, after good ones that mustn't be applied either
+	size = encode_every_patch(frame, N_GENERATORS - 1, 0);
+	const size_t generator_at = PATCH_HEADER_SIZE;
+	const size_t enabled_at   = generator_at + PATCH_GENERATOR_SIZE;
+	const size_t velocity_at  = enabled_at + PATCH_FIELD_SIZE;
+	const size_t channel_at   = velocity_at + PATCH_FIELD_SIZE;
+	const size_t index_at[] = {generator_at + 1, enabled_at + 1, velocity_at + 1};
+	for (uint i = 0; i < sizeof(index_at) / sizeof(index_at[0]); i++) {
+		frame[index_at[i]] = N_GENERATORS & 0xFF;
+		frame[index_at[i] + 1] = N_GENERATORS >> 8;
+		rejected(frame, size);
+		frame[index_at[i]] = (N_GENERATORS - 1) & 0xFF;
+		frame[index_at[i] + 1] = (N_GENERATORS - 1) >> 8;
+	}
+	frame[channel_at + 1] = N_MIDI_CHANNELS;
+	rejected(frame, size);
+	frame[channel_at + 1] = 0xFF;
+	rejected(frame, size);
+	frame[channel_at + 1] = 0;
+	CHECK(apply(frame, size));
+
+	// an opcode that doesn't exist
+	frame[channel_at] = 0;
+	rejected(frame, size);
+	frame[channel_at] = PATCH_ENVELOPE + 1;
+	rejected(frame, size);
+}
+
+int main(void)
+{
+	test_global();
+	test_generator();
+	test_patch();
+	test_wrong_version();
+	test_wrong_length();
+	test_out_of_range();
+	return 0;
+}
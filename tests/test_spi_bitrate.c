@@ -0,0 +1,72 @@
+// spi_qualify_bitrate against the stand-in FPGA in spi.c (SPI_LOOPBACK), whose
+// bus flips bits above the bitrate SPI_LOOPBACK is set to. It has to settle
+// SPI_QUALIFY_MARGIN steps below the fastest bitrate that still works, having
+// counted the test patterns that came back wrong, and frames then have to get
+// through at that bitrate without anything sent again. Built with a couple of
+// limits, see CMakeLists.txt.
+#include <string.h>
+#include "host.h"
+#include "spi.h"
+
+static const uint32_t bitrates[] = SPI_BITRATES;
+#define N_BITRATES (sizeof(bitrates) / sizeof(bitrates[0]))
+
+Ecode_t SPIDRV_Init(SPIDRV_Handle_t handle, SPIDRV_Init_t* initData)
+{
+	(void) handle;
+	CHECK(initData->bitRate == SPI_BITRATE);
+	return ECODE_EMDRV_SPIDRV_OK;
+}
+
+static uint index_of(uint32_t bitrate)
+{
+	for (uint i = 0; i < N_BITRATES; i++)
+		if (bitrates[i] == bitrate) return i;
+	CHECK(!"bitrate not in SPI_BITRATES");
+	return 0;
+}
+
+static void test_qualify(void)
+{
+	uint32_t bitrate = spi_qualify_bitrate();
+	SpiStats stats = spi_get_stats();
+	CHECK(stats.bitrate == bitrate);
+
+	uint chosen = index_of(bitrate);
+	uint fastest = chosen + SPI_QUALIFY_MARGIN; // that passed
+	CHECK(fastest + 1 < N_BITRATES);
+	CHECK(bitrates[fastest] <= SPI_LOOPBACK);
+	CHECK(bitrates[fastest + 1] > SPI_LOOPBACK);
+
+	// all rounds of every bitrate up to the first that failed, and that one failed
+	CHECK(stats.link_tests == (fastest + 2) * SPI_QUALIFY_ROUNDS);
+	CHECK(stats.link_test_errors > 0);
+	CHECK(stats.link_test_errors <= SPI_QUALIFY_ROUNDS);
+}
+
+static void test_frames_after(void)
+{
+	SpiStats before = spi_get_stats();
+	for (uint i = 0; i < 100; i++) {
+		MicrocontrollerGeneratorState state = {i % 2, 0, 40 + i % 50, 0, 1 + i % 127};
+		byte frame[PROTOCOL_GENERATOR_SIZE];
+		size_t size = protocol_encode_generator(frame, i % N_GENERATORS, true, &state);
+		CHECK(spi_transmit(frame, size));
+		CHECK(spi_idle()); // the stand-in answers right away
+		CHECK(memcmp(&spi_loopback_mirror()->generators[i % N_GENERATORS], &state, sizeof(state)) == 0);
+	}
+	SpiStats after = spi_get_stats();
+	CHECK(after.frames_sent == before.frames_sent + 100);
+	CHECK(after.frames_resent == before.frames_resent);
+	CHECK(after.status_missing == before.status_missing);
+	CHECK(after.link_lost == before.link_lost);
+	CHECK(!spi_resync_pending());
+}
+
+int main(void)
+{
+	spi_init();
+	test_qualify();
+	test_frames_after();
+	return 0;
+}